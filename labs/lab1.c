@@ -1,66 +1,129 @@
-// C program for QuickSort
+// Benchmark of the parallel sorts in sort.h
+#include <omp.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include "sort.h"
 
-// Utility function to swap tp integers
-void swap(int* p1, int* p2)
+// Deterministic keys between 0 and range - 1 for element i, the same for every thread count
+unsigned key_at(long i, unsigned range)
 {
-    int temp;
-    temp = *p1;
-    *p1 = *p2;
-    *p2 = temp;
+    unsigned x = (unsigned)i * 2654435761u + 12345u;
+    x ^= x >> 15;
+    x *= 2246822519u;
+    x ^= x >> 13;
+    return x % range;
 }
 
-int partition(int arr[], int low, int high)
+int compare_ints(const void *a, const void *b)
 {
-    // choose the pivot
-    int pivot = arr[high];
-
-    // Index of smaller element and Indicate
-    // the right position of pivot found so far
-    int i = (low - 1);
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
 
-    for (int j = low; j <= high - 1; j++) {
-        // If current element is smaller than the pivot
-        if (arr[j] < pivot) {
-            // Increment index of smaller element
-            i++;
-            swap(&arr[i], &arr[j]);
-        }
+// Sorted ascending and the same multiset of keys as the input (checked through the sum)
+int check_sorted(const unsigned *arr, long n, long long expectedSum)
+{
+    long long sum = 0;
+    long unsorted = 0;
+    #pragma omp parallel for reduction(+:sum, unsorted)
+    for (long i = 0; i < n; i++) {
+        sum += arr[i];
+        if (i > 0 && arr[i - 1] > arr[i]) unsorted++;
     }
-    swap(&arr[i + 1], &arr[high]);
-    return (i + 1);
+    return unsorted == 0 && sum == expectedSum;
 }
 
-// The Quicksort function Implement
+void report(const char *name, long n, double seconds, int ok)
+{
+    printf("  %-12s %10.4f s  %9.1f Mkeys/s  %s\n", name, seconds, n / seconds / 1e6, ok ? "ok" : "WRONG");
+}
 
-void quickSort(int arr[], int low, int high)
+int main(int argc, char *argv[])
 {
-    // when low is less than high
-    if (low < high) {
-        // pi is the partition return index of pivot
+    // Sizes grow by 10x from minSize up to maxSize
+    long maxSize = argc > 1 ? atol(argv[1]) : 100000000;
+    long minSize = argc > 2 ? atol(argv[2]) : 1000;
+    // Keys below range, a small range gives many duplicates like the row numbers of matrix triples
+    unsigned range = argc > 3 ? (unsigned)atol(argv[3]) : 2147483647u;
+    // quicksort sorts the same keys as ints
+    if (range > 2147483647u) range = 2147483647u;
+
+    unsigned *original = (unsigned*)malloc(maxSize * sizeof(unsigned));
+    unsigned *keys = (unsigned*)malloc(maxSize * sizeof(unsigned));
+    unsigned *values = (unsigned*)malloc(maxSize * sizeof(unsigned));
+    if (original == NULL || keys == NULL || values == NULL) {
+        printf("Cannot allocate %ld keys\n", maxSize);
+        return 1;
+    }
+    printf("Sorting with %d threads, keys below %u\n", omp_get_max_threads(), range);
+
+    for (long n = minSize; n <= maxSize; n *= 10) {
+        long long expectedSum = 0;
+        #pragma omp parallel for reduction(+:expectedSum)
+        for (long i = 0; i < n; i++) {
+            original[i] = key_at(i, range);
+            expectedSum += original[i];
+        }
+        printf("n = %ld\n", n);
+
+        // libc qsort as the serial baseline, skipped where it would dominate the run
+        if (n <= 100000000) {
+            memcpy(keys, original, n * sizeof(unsigned));
+            double start = omp_get_wtime();
+            qsort(keys, n, sizeof(int), compare_ints);
+            report("qsort", n, omp_get_wtime() - start, check_sorted(keys, n, expectedSum));
+        }
 
-        int pi = partition(arr, low, high);
+        memcpy(keys, original, n * sizeof(unsigned));
+        double start = omp_get_wtime();
+        sort_quick((int*)keys, n);
+        report("quicksort", n, omp_get_wtime() - start, check_sorted(keys, n, expectedSum));
 
-        // Recursion Call
-        // smaller element than pivot goes left and
-        // higher element goes right
-        quickSort(arr, low, pi - 1);
-        quickSort(arr, pi + 1, high);
+        memcpy(keys, original, n * sizeof(unsigned));
+        start = omp_get_wtime();
+        sort_radix(keys, n);
+        report("radix", n, omp_get_wtime() - start, check_sorted(keys, n, expectedSum));
+
+        // Values are the original positions, each must still point at its key and ties must keep their order
+        memcpy(keys, original, n * sizeof(unsigned));
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) values[i] = i;
+        start = omp_get_wtime();
+        sort_radix_pairs(keys, values, n);
+        double elapsed = omp_get_wtime() - start;
+        long wrong = 0;
+        #pragma omp parallel for reduction(+:wrong)
+        for (long i = 0; i < n; i++) {
+            if (original[values[i]] != keys[i]) wrong++;
+            if (i > 0 && keys[i - 1] == keys[i] && values[i - 1] > values[i]) wrong++;
+        }
+        report("radix pairs", n, elapsed, wrong == 0 && check_sorted(keys, n, expectedSum));
     }
-}
 
-int main()
-{
-    int arr[] = { 10, 7, 8, 9, 1, 5 };
-    int n = sizeof(arr) / sizeof(arr[0]);
-  
-    // Function call
-    quickSort(arr, 0, n - 1);
-  
-  // Print the sorted array
-    printf("Sorted Array\n");
-    for (int i = 0; i < n; i++) {
-        printf("%d ", arr[i]);
+    // Triples of a sparse matrix, sorted by row then column
+    long n = maxSize < 10000000 ? maxSize : 10000000;
+    int *rows = (int*)malloc(n * sizeof(int)), *cols = (int*)malloc(n * sizeof(int)), *vals = (int*)malloc(n * sizeof(int));
+    for (long i = 0; i < n; i++) {
+        rows[i] = key_at(i, 100000);
+        cols[i] = key_at(i + n, 100000);
+        vals[i] = rows[i] ^ cols[i];
     }
+    double start = omp_get_wtime();
+    sort_triples(rows, cols, vals, n);
+    double elapsed = omp_get_wtime() - start;
+    long wrong = 0;
+    for (long i = 0; i < n; i++) {
+        if (vals[i] != (rows[i] ^ cols[i])) wrong++;
+        if (i > 0 && (rows[i - 1] > rows[i] || (rows[i - 1] == rows[i] && cols[i - 1] > cols[i]))) wrong++;
+    }
+    printf("triples n = %ld\n", n);
+    report("row, col", n, elapsed, wrong == 0);
+
+    free(rows);
+    free(cols);
+    free(vals);
+    free(original);
+    free(keys);
+    free(values);
     return 0;
 }
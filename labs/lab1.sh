@@ -0,0 +1,15 @@
+#!/bin/bash
+#SBATCH --nodes=1
+#SBATCH --ntasks=1
+#SBATCH --cpus-per-task=64
+#SBATCH --partition=work
+#SBATCH --account=courses0101
+#SBATCH --mem=32G
+#SBATCH --time=00:30:00
+# Usage: sbatch lab1.sh [maxSize] [minSize] [key range], e.g. sbatch lab1.sh 1000000000 1000 100000
+cc -O3 -march=native -o lab1 -fopenmp ./lab1.c
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
+export OMP_PROC_BIND=spread
+export OMP_PLACES=cores
+
+srun ./lab1 $1 $2 $3
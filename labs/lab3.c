@@ -1,49 +1,98 @@
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include "reduction.h"
+
+// Best wall time of a few repeats, so page faults and frequency ramp-up of the first run are not counted
+#define REPEATS 5
+
+// Deterministic numbers between 0 and 1 for element i, so the arrays are the same for every thread count
+static float item_at(long i, unsigned seed) {
+  unsigned x = (unsigned)i * 2654435761u + seed;
+  x ^= x >> 15;
+  x *= 2246822519u;
+  x ^= x >> 13;
+  return (float)(x & 0xFFFFFF) / 0xFFFFFF;
+}
+
+// Copy bandwidth in GB/s, the reference the reductions are compared against
+double copy_bandwidth(float *dst, const float *src, long n) {
+  double best = 1e30;
+  for (int r = 0; r < REPEATS; r++) {
+    double start = omp_get_wtime();
+    #pragma omp parallel
+    {
+      int nThreads = omp_get_num_threads(), t = omp_get_thread_num();
+      long first = n * t / nThreads, last = n * (t + 1) / nThreads;
+      memcpy(dst + first, src + first, (last - first) * sizeof(float));
+    }
+    double elapsed = omp_get_wtime() - start;
+    if (elapsed < best) best = elapsed;
+  }
+  // memcpy reads and writes every byte
+  return 2.0 * n * sizeof(float) / best / 1e9;
+}
 
 int main(int argc, char *argv[]) {
   // Array of floats
-  int array_size = 276447232;
+  long array_size = argc > 1 ? atol(argv[1]) : 276447232;
   float *array = (float*)malloc(array_size * sizeof(float));
-  float arraySum = 0;
+  float *other = (float*)malloc(array_size * sizeof(float));
+  if (array == NULL || other == NULL) {
+    printf("Cannot allocate %ld floats\n", array_size);
+    return 1;
+  }
 
-  // initialize array and find the sum;
-  for (int i = 0; i < array_size; i++) {
-      float item = ((float)rand() / RAND_MAX) * 1.0f;
-      array[i] = item; // Numbers between 0 and 1
-      arraySum += item;
+  // initialize the arrays in parallel so their pages are spread like the reductions will read them
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < array_size; i++) {
+    array[i] = item_at(i, 1);
+    other[i] = item_at(i, 2);
   }
 
-  // start clock on execution
-  clock_t start_time = clock();
+  int nThreads = omp_get_max_threads();
+  double bandwidth = copy_bandwidth(other, array, array_size);
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < array_size; i++) {
+    other[i] = item_at(i, 2);
+  }
+  printf("Reducing %ld floats with %d threads, copy bandwidth %.2f GB/s\n", array_size, nThreads, bandwidth);
 
-  float totalSum;
-  float localSum;
-  #pragma omp parallel private(localSum) reduction(+:totalSum)
-  {
-    #pragma omp for
-      for (int i = 0; i < array_size; i++) {
-          localSum += array[i];
+  const char *names[] = {"sum fast", "sum pairwise", "sum kahan", "dot fast", "dot pairwise", "dot kahan", "min", "max"};
+  double results[8];
+  for (int op = 0; op < 8; op++) {
+    double best = 1e30;
+    for (int r = 0; r < REPEATS; r++) {
+      double start = omp_get_wtime();
+      if (op < 3) {
+        results[op] = reduce_sum(array, array_size, (reduce_mode)op);
+      } else if (op < 6) {
+        results[op] = reduce_dot(array, other, array_size, (reduce_mode)(op - 3));
+      } else if (op == 6) {
+        results[op] = reduce_min(array, array_size);
+      } else {
+        results[op] = reduce_max(array, array_size);
       }
-    //Code here will be executed by all threads
-    printf("localSum %f in thread %d\n", localSum, omp_get_thread_num());
-    totalSum += localSum;
-    // Make sure all threads see the most up-to-date totalSum
-    #pragma omp flush(totalSum)
+      double elapsed = omp_get_wtime() - start;
+      if (elapsed < best) best = elapsed;
+    }
+    double bytes = (op >= 3 && op < 6 ? 2.0 : 1.0) * array_size * sizeof(float);
+    double gbs = bytes / best / 1e9;
+    printf("%-13s %.8f in %f seconds, %.2f GB/s (%.0f%% of copy bandwidth)\n", names[op], results[op], best, gbs, 100 * gbs / bandwidth);
   }
-  printf("totalSum in all threads %f\n Actual Sum of the array %f\n", totalSum, arraySum);
-
-
 
-  // Record the end time
-  clock_t end_time = clock();
+  // The deterministic modes must give the same bits on one thread
+  omp_set_num_threads(1);
+  double serialPairwise = reduce_sum(array, array_size, REDUCE_PAIRWISE);
+  double serialKahan = reduce_sum(array, array_size, REDUCE_KAHAN);
+  double serialFast = reduce_sum(array, array_size, REDUCE_FAST);
+  omp_set_num_threads(nThreads);
+  printf("1 thread vs %d threads: pairwise %s, kahan %s, fast differs by %g\n", nThreads,
+         serialPairwise == results[1] ? "identical" : "DIFFERENT",
+         serialKahan == results[2] ? "identical" : "DIFFERENT", serialFast - results[0]);
 
-  // Calculate the elapsed time in seconds
-  double time_spent = (double)(end_time - start_time) / CLOCKS_PER_SEC;
-  
-  // Print the elapsed time
-  printf("Time taken to complete sum task: %f seconds\n", time_spent);
+  free(array);
+  free(other);
   return 0;
 }
@@ -1,11 +1,15 @@
 #!/bin/bash
 #SBATCH --nodes=1
 #SBATCH --ntasks=1
+#SBATCH --cpus-per-task=64
 #SBATCH --partition=work
 #SBATCH --account=courses0101
 #SBATCH --mem=4G
-#SBATCH --time=00:00:01
-cc -o lab3 -fopenmp ./lab3.c
-export OMP_NUM_THREADS=100
+#SBATCH --time=00:05:00
+# Usage: sbatch lab3.sh [array_size]
+cc -O3 -march=native -o lab3 -fopenmp ./lab3.c
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
+export OMP_PROC_BIND=spread
+export OMP_PLACES=cores
 
-srun ./lab3
+srun ./lab3 $1
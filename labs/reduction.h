@@ -0,0 +1,175 @@
+#ifndef REDUCTION_H
+#define REDUCTION_H
+
+#include <omp.h>
+#include <float.h>
+#include <stdlib.h>
+
+// Floats per block, 16KB so a block stays in L1 while it is reduced
+#define REDUCE_BLOCK 4096
+// Independent double accumulators per block, four AVX2 registers to hide the latency of the adds
+#define REDUCE_LANES 16
+
+/**
+ * reduce_mode
+ * @description REDUCE_FAST lets each thread sum its blocks in any order, so the last bits change with the thread count.
+ * @description REDUCE_PAIRWISE and REDUCE_KAHAN reduce fixed blocks and combine the block results in a fixed order,
+ * @description so the result is the same for every thread count
+ */
+typedef enum { REDUCE_FAST, REDUCE_PAIRWISE, REDUCE_KAHAN } reduce_mode;
+
+/**
+ * reduce_block
+ * @description sum of a[i] * b[i] (or of a[i] when b is NULL) over one block, in REDUCE_LANES lanes
+ * @param kahan {int} compensate each lane for the rounding of every addition
+ */
+static inline double reduce_block(const float *a, const float *b, long n, int kahan) {
+  double sum[REDUCE_LANES] = {0}, carry[REDUCE_LANES] = {0};
+  long i = 0;
+  // One loop per mode, so the plain loop carries no compensation work and vectorizes on its own
+  if (kahan) {
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+      for (int l = 0; l < REDUCE_LANES; l++) {
+        double y = (b ? (double)a[i + l] * b[i + l] : a[i + l]) - carry[l];
+        double t = sum[l] + y;
+        carry[l] = (t - sum[l]) - y;
+        sum[l] = t;
+      }
+    }
+    for (int l = 0; l < REDUCE_LANES; l++) sum[l] -= carry[l];
+  } else if (b) {
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+      for (int l = 0; l < REDUCE_LANES; l++) sum[l] += (double)a[i + l] * b[i + l];
+    }
+  } else {
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+      for (int l = 0; l < REDUCE_LANES; l++) sum[l] += a[i + l];
+    }
+  }
+  for (; i < n; i++) {
+    sum[0] += b ? (double)a[i] * b[i] : a[i];
+  }
+
+  // Combine the lanes pairwise
+  for (int width = REDUCE_LANES / 2; width > 0; width /= 2) {
+    for (int l = 0; l < width; l++) sum[l] += sum[l + width];
+  }
+  return sum[0];
+}
+
+/**
+ * reduce_pairwise
+ * @description pairwise sum of the block results, error grows with log(nBlocks) instead of nBlocks
+ */
+static inline double reduce_pairwise(const double *partial, long n) {
+  if (n <= 8) {
+    double sum = 0;
+    for (long i = 0; i < n; i++) sum += partial[i];
+    return sum;
+  }
+  return reduce_pairwise(partial, n / 2) + reduce_pairwise(partial + n / 2, n - n / 2);
+}
+
+/**
+ * reduce_kahan
+ * @description compensated sum of the block results in block order
+ */
+static inline double reduce_kahan(const double *partial, long n) {
+  double sum = 0, carry = 0;
+  for (long i = 0; i < n; i++) {
+    double y = partial[i] - carry;
+    double t = sum + y;
+    carry = (t - sum) - y;
+    sum = t;
+  }
+  return sum;
+}
+
+/**
+ * reduce_blocks
+ * @description parallel sum or dot product over blocks of REDUCE_BLOCK floats
+ * @param b {float*} second operand of a dot product, NULL for a sum
+ */
+static inline double reduce_blocks(const float *a, const float *b, long n, reduce_mode mode) {
+  long nBlocks = (n + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+
+  if (mode == REDUCE_FAST) {
+    double total = 0;
+    #pragma omp parallel for schedule(static) reduction(+:total)
+    for (long blk = 0; blk < nBlocks; blk++) {
+      long first = blk * REDUCE_BLOCK;
+      long count = n - first < REDUCE_BLOCK ? n - first : REDUCE_BLOCK;
+      total += reduce_block(a + first, b ? b + first : NULL, count, 0);
+    }
+    return total;
+  }
+
+  // One slot per block, so the combining order does not depend on which thread reduced which block
+  double *partial = (double*)malloc(nBlocks * sizeof(double));
+  #pragma omp parallel for schedule(static)
+  for (long blk = 0; blk < nBlocks; blk++) {
+    long first = blk * REDUCE_BLOCK;
+    long count = n - first < REDUCE_BLOCK ? n - first : REDUCE_BLOCK;
+    partial[blk] = reduce_block(a + first, b ? b + first : NULL, count, mode == REDUCE_KAHAN);
+  }
+  double total = mode == REDUCE_KAHAN ? reduce_kahan(partial, nBlocks) : reduce_pairwise(partial, nBlocks);
+  free(partial);
+  return total;
+}
+
+/**
+ * reduce_sum
+ * @description sum of n floats, accumulated in double
+ */
+static inline double reduce_sum(const float *a, long n, reduce_mode mode) {
+  return reduce_blocks(a, NULL, n, mode);
+}
+
+/**
+ * reduce_dot
+ * @description dot product of two arrays of n floats, accumulated in double
+ */
+static inline double reduce_dot(const float *a, const float *b, long n, reduce_mode mode) {
+  return reduce_blocks(a, b, n, mode);
+}
+
+/**
+ * reduce_min
+ * @description smallest of n floats, the same for every thread count
+ */
+static inline float reduce_min(const float *a, long n) {
+  float result = FLT_MAX;
+  #pragma omp parallel for simd schedule(static) reduction(min:result)
+  for (long i = 0; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+/**
+ * reduce_max
+ * @description largest of n floats, the same for every thread count
+ */
+static inline float reduce_max(const float *a, long n) {
+  float result = -FLT_MAX;
+  #pragma omp parallel for simd schedule(static) reduction(max:result)
+  for (long i = 0; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+/**
+ * reduce_checksum
+ * @description exact sum of n ints, for checksums of integer results
+ */
+static inline long long reduce_checksum(const int *a, long n) {
+  long long result = 0;
+  #pragma omp parallel for simd schedule(static) reduction(+:result)
+  for (long i = 0; i < n; i++) {
+    result += a[i];
+  }
+  return result;
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Below this size insertion sort beats partitioning
+#define SORT_INSERTION 32
+// Below this size a partition is sorted by the thread that made it, a task costs more than it saves
+#define SORT_TASK_CUTOFF 16384
+// Bits per radix pass, 4 passes over 32-bit keys with 256 buckets per thread
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/**
+ * sort_swap
+ * @description Utility function to swap two integers
+ */
+static inline void sort_swap(int *p1, int *p2) {
+    int temp = *p1;
+    *p1 = *p2;
+    *p2 = temp;
+}
+
+/**
+ * sort_insertion
+ * @description insertion sort for the small partitions at the bottom of the quicksort
+ */
+static inline void sort_insertion(int arr[], long n) {
+    for (long i = 1; i < n; i++) {
+        int item = arr[i];
+        long j = i - 1;
+        while (j >= 0 && arr[j] > item) {
+            arr[j + 1] = arr[j];
+            j--;
+        }
+        arr[j + 1] = item;
+    }
+}
+
+static inline int sort_median3(int a, int b, int c) {
+    if (a < b) return b < c ? b : (a < c ? c : a);
+    return a < c ? a : (b < c ? c : b);
+}
+
+/**
+ * sort_pivot
+ * @description median of three, or for large partitions the median of three medians of three (ninther),
+ * @description so sorted, reversed and organ-pipe inputs still split near the middle
+ */
+static inline int sort_pivot(int arr[], long n) {
+    long mid = n / 2, last = n - 1;
+    if (n < 1024) return sort_median3(arr[0], arr[mid], arr[last]);
+    long step = n / 8;
+    return sort_median3(sort_median3(arr[0], arr[step], arr[2 * step]),
+                        sort_median3(arr[mid - step], arr[mid], arr[mid + step]),
+                        sort_median3(arr[last - 2 * step], arr[last - step], arr[last]));
+}
+
+/**
+ * sort_partition
+ * @description three-way partition around pivot: [0, lt) < pivot, [lt, gt) == pivot, [gt, n) > pivot.
+ * @description Keys equal to the pivot are never looked at again, so runs of duplicates do not go quadratic
+ */
+static inline void sort_partition(int arr[], long n, int pivot, long *lt, long *gt) {
+    long less = 0, i = 0, greater = n;
+    while (i < greater) {
+        if (arr[i] < pivot) {
+            sort_swap(&arr[less++], &arr[i++]);
+        } else if (arr[i] > pivot) {
+            sort_swap(&arr[i], &arr[--greater]);
+        } else {
+            i++;
+        }
+    }
+    *lt = less;
+    *gt = greater;
+}
+
+/**
+ * sort_quick_task
+ * @description quicksort body: the smaller side becomes a task when it is large enough, the larger side
+ * @description is handled by the loop, so the stack stays O(log n) deep
+ */
+static void sort_quick_task(int arr[], long n) {
+    while (n > SORT_INSERTION) {
+        long lt, gt;
+        sort_partition(arr, n, sort_pivot(arr, n), &lt, &gt);
+
+        int *small = arr, *large = arr + gt;
+        long nSmall = lt, nLarge = n - gt;
+        if (nSmall > nLarge) {
+            small = arr + gt;
+            nSmall = n - gt;
+            large = arr;
+            nLarge = lt;
+        }
+
+        if (nSmall > SORT_TASK_CUTOFF) {
+            #pragma omp task firstprivate(small, nSmall)
+            sort_quick_task(small, nSmall);
+        } else {
+            sort_quick_task(small, nSmall);
+        }
+        arr = large;
+        n = nLarge;
+    }
+    sort_insertion(arr, n);
+}
+
+/**
+ * sort_quick
+ * @description parallel in-place quicksort of n ints with OpenMP tasks
+ */
+static inline void sort_quick(int arr[], long n) {
+    #pragma omp parallel
+    {
+        #pragma omp single
+        sort_quick_task(arr, n);
+    }
+}
+
+/**
+ * sort_radix_impl
+ * @description parallel LSD radix sort of 32-bit keys, stable, with values moved along when not NULL.
+ * @description Each thread counts the digits of its own slice, the counts are turned into offsets in digit-major
+ * @description thread-minor order (which keeps the sort stable) and each thread scatters its slice.
+ * @description Passes where every key has the same digit are skipped
+ */
+static inline void sort_radix_impl(unsigned *keys, unsigned *values, long n) {
+    int maxThreads = omp_get_max_threads();
+    unsigned *tmpKeys = (unsigned*)malloc(n * sizeof(unsigned));
+    unsigned *tmpValues = values ? (unsigned*)malloc(n * sizeof(unsigned)) : NULL;
+    long *offsets = (long*)malloc((long)maxThreads * RADIX_BUCKETS * sizeof(long));
+
+    unsigned *srcKeys = keys, *dstKeys = tmpKeys, *srcValues = values, *dstValues = tmpValues;
+    for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+        int skip = 0;
+        #pragma omp parallel num_threads(maxThreads)
+        {
+            int t = omp_get_thread_num(), nThreads = omp_get_num_threads();
+            long first = n * t / nThreads, last = n * (t + 1) / nThreads;
+            long *count = offsets + (long)t * RADIX_BUCKETS;
+
+            memset(count, 0, RADIX_BUCKETS * sizeof(long));
+            for (long i = first; i < last; i++) {
+                count[(srcKeys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            }
+            #pragma omp barrier
+
+            #pragma omp single
+            {
+                long total = 0;
+                for (int d = 0; d < RADIX_BUCKETS; d++) {
+                    long digitCount = 0;
+                    for (int tt = 0; tt < nThreads; tt++) {
+                        long c = offsets[(long)tt * RADIX_BUCKETS + d];
+                        offsets[(long)tt * RADIX_BUCKETS + d] = total;
+                        total += c;
+                        digitCount += c;
+                    }
+                    if (digitCount == n) skip = 1;
+                }
+            }
+
+            if (!skip) {
+                for (long i = first; i < last; i++) {
+                    long pos = count[(srcKeys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                    dstKeys[pos] = srcKeys[i];
+                    if (srcValues) dstValues[pos] = srcValues[i];
+                }
+            }
+        }
+
+        if (!skip) {
+            unsigned *swapKeys = srcKeys, *swapValues = srcValues;
+            srcKeys = dstKeys;
+            dstKeys = swapKeys;
+            srcValues = dstValues;
+            dstValues = swapValues;
+        }
+    }
+
+    // An odd number of passes left the result in the scratch buffers
+    if (srcKeys != keys) {
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++) {
+            keys[i] = srcKeys[i];
+            if (values) values[i] = srcValues[i];
+        }
+    }
+
+    free(tmpKeys);
+    free(tmpValues);
+    free(offsets);
+}
+
+/**
+ * sort_radix
+ * @description parallel LSD radix sort of n unsigned 32-bit keys
+ */
+static inline void sort_radix(unsigned *keys, long n) {
+    sort_radix_impl(keys, NULL, n);
+}
+
+/**
+ * sort_radix_pairs
+ * @description parallel stable LSD radix sort of n unsigned 32-bit keys, values follow their keys
+ */
+static inline void sort_radix_pairs(unsigned *keys, unsigned *values, long n) {
+    sort_radix_impl(keys, values, n);
+}
+
+/**
+ * sort_triples
+ * @description sort (row, col, value) triples of a sparse matrix by row then column. The permutation is radix
+ * @description sorted by column, then stably by row, and applied to the three arrays once at the end
+ * @param rows {int*} row of each triple, non-negative
+ * @param cols {int*} column of each triple, non-negative
+ */
+static inline void sort_triples(int *rows, int *cols, int *values, long n) {
+    unsigned *keys = (unsigned*)malloc(n * sizeof(unsigned));
+    unsigned *perm = (unsigned*)malloc(n * sizeof(unsigned));
+    int *scratch = (int*)malloc(n * sizeof(int));
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        keys[i] = cols[i];
+        perm[i] = i;
+    }
+    sort_radix_pairs(keys, perm, n);
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        keys[i] = rows[perm[i]];
+    }
+    sort_radix_pairs(keys, perm, n);
+
+    // Apply the permutation to each array through the scratch buffer
+    int *arrays[3] = {rows, cols, values};
+    for (int a = 0; a < 3; a++) {
+        int *array = arrays[a];
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++) scratch[i] = array[perm[i]];
+        memcpy(array, scratch, n * sizeof(int));
+    }
+
+    free(keys);
+    free(perm);
+    free(scratch);
+}
+
+#endif
@@ -1,15 +1,292 @@
     #include <omp.h>
     #include <stdio.h>
     #include <stdlib.h>
+    #include <string.h>
     #include <iostream>
     #include <string>
     #include <vector>
     #include <chrono>
+    #include <algorithm>
+    #include <cmath>
+    #include <map>
+    #include <atomic>
+    #include <thread>
+    #include <mutex>
+    #include <condition_variable>
+    #include <sstream>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/mman.h>
+    #include <immintrin.h>
     using namespace std;
 
     #define DEBUG false // Enable to output matrix generation and check integrity
     #define NROWS 100000 // Number of rows of the matrix
     #define NCOLS 100000 // Number of columns of the matrix
+    #define TILE_MIN_COLS 1024 // Narrowest panel of the tiled kernel, narrower panels spend more on the bounds table than they save
+    #define ARENA_HUGEPAGES 1 // Backing of the matrix arena: 0 = regular pages, 1 = transparent hugepages, 2 = explicit hugepages
+
+    #define HUGEPAGE_SIZE (2UL << 20)
+
+    /**
+     * Arena
+     * @description bump allocator over one large anonymous mapping backed by hugepages, used for all matrix and result rows.
+     * @description Blocks are never freed one by one, the arena is rewound to a mark or unmapped as a whole
+     */
+    struct Arena {
+        char *base = nullptr;
+        size_t capacity = 0;
+        atomic<size_t> used{0};
+
+        /**
+         * reserve
+         * @description map the arena, pages are only committed when first touched so overestimating is cheap
+         * @param bytes {size_t} capacity of the arena
+         */
+        void reserve(size_t bytes) {
+            release();
+            capacity = (bytes + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+            void *mapping = MAP_FAILED;
+            if (ARENA_HUGEPAGES == 2) {
+                // Without MAP_NORESERVE the hugepages are reserved here, so a short pool fails this call instead of a later page fault (SIGBUS)
+                mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (mapping == MAP_FAILED) cerr << "Explicit hugepages unavailable, falling back to transparent hugepages" << endl;
+            }
+            if (mapping == MAP_FAILED) {
+                mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (mapping != MAP_FAILED && ARENA_HUGEPAGES >= 1) madvise(mapping, capacity, MADV_HUGEPAGE);
+            }
+            if (mapping == MAP_FAILED) {
+                cerr << "Error mapping matrix arena, using the default allocator!" << endl;
+                capacity = 0;
+                return;
+            }
+            base = (char*)mapping;
+            used = 0;
+        }
+
+        // returns nullptr when the block does not fit so the caller can fall back to the heap, smaller blocks may still fit later
+        void *allocate(size_t bytes) {
+            if (base == nullptr) return nullptr;
+            bytes = (bytes + 63) & ~(size_t)63; // keep every block cache line aligned
+            size_t offset = used.load();
+            do {
+                if (bytes > capacity - offset) return nullptr;
+            } while (!used.compare_exchange_weak(offset, offset + bytes));
+            return base + offset;
+        }
+
+        bool owns(const void *p) const {
+            return base != nullptr && (const char*)p >= base && (const char*)p < base + capacity;
+        }
+
+        size_t mark() const { return used.load(); }
+
+        // drop every block allocated after the mark, they must no longer be in use
+        void rewind(size_t mark) { used = min(mark, capacity); }
+
+        /**
+         * prefault
+         * @description touch every page after the blocks in use, so they are committed once instead of by whichever run
+         * @description first allocates them after a rewind. Pages are touched in parallel to spread them like the kernels do
+         */
+        void prefault() {
+            if (base == nullptr) return;
+            long first = used.load() / 4096 + 1, last = capacity / 4096;
+            #pragma omp parallel for schedule(static)
+            for (long page = first; page < last; page++) base[page * 4096] = 0;
+        }
+
+        void release() {
+            if (base != nullptr) munmap(base, capacity);
+            base = nullptr;
+            capacity = 0;
+            used = 0;
+        }
+
+        ~Arena() { release(); }
+    };
+
+    Arena matrixArena;
+
+    /**
+     * ArenaAllocator
+     * @description STL allocator drawing from matrixArena, falls back to the heap when the arena is not reserved or full
+     */
+    template <typename T>
+    struct ArenaAllocator {
+        typedef T value_type;
+        ArenaAllocator() {}
+        template <typename U> ArenaAllocator(const ArenaAllocator<U> &) {}
+
+        T *allocate(size_t n) {
+            void *p = matrixArena.allocate(n * sizeof(T));
+            return (T*)(p != nullptr ? p : ::operator new(n * sizeof(T)));
+        }
+        void deallocate(T *p, size_t) {
+            if (!matrixArena.owns(p)) ::operator delete(p);
+        }
+    };
+    template <typename T, typename U> bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+    template <typename T, typename U> bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+
+    typedef vector<int, ArenaAllocator<int>> Row;
+    typedef vector<Row> Matrix;
+
+    /**
+     * expectedRowNonZeros
+     * @description capacity to reserve for a compressed row, the mean plus a few standard deviations of the binomial count
+     */
+    int expectedRowNonZeros(int percent) {
+        double mean = (double)NCOLS * percent / 100;
+        return (int)(mean + 4 * sqrt(mean)) + 2;
+    }
+
+    /**
+     * reserveMatrixArena
+     * @description size the arena from the estimated nnz of the compressed X and Y plus the dense results
+     * @param percent {int} probability of non-zeros
+     * @param nDenseMatrices {int} number of dense NROWS x NCOLS matrices alive at the same time
+     */
+    void reserveMatrixArena(int percent, int nDenseMatrices) {
+        size_t rowBytes = ((size_t)expectedRowNonZeros(percent) * sizeof(int) + 63) & ~(size_t)63;
+        size_t compressedBytes = 4 * (size_t)NROWS * rowBytes; // values and indices of X and Y
+        size_t denseBytes = (size_t)nDenseMatrices * NROWS * (((size_t)NCOLS * sizeof(int) + 63) & ~(size_t)63);
+        matrixArena.reserve(compressedBytes + denseBytes);
+        cout << "Matrix arena: " << (compressedBytes + denseBytes) / (1UL << 20) << " MB reserved" << endl;
+    }
+
+    /**
+     * PackedIndices
+     * @description delta-encoded column indices of a compressed matrix (indices are strictly increasing within a row).
+     * @description Row r starts at bytes[offsets[r]] with a header (delta width in bytes, count, first index)
+     * @description followed by count - 1 deltas of 1, 2 or 4 bytes, the narrowest width that fits the row's largest gap
+     */
+    struct PackedIndices {
+        vector<uint8_t> bytes;
+        vector<long> offsets;
+    };
+
+    #define PACKED_ROW_HEADER 9 // 1 byte width + 4 bytes count + 4 bytes first index
+    #define PACKED_CHUNK 64 // indices decoded at a time inside the multiply
+
+    int packedDeltaWidth(const Row &rowIndices) {
+        int maxDelta = 0;
+        for (int k = 1; k < rowIndices.size(); k++) maxDelta = max(maxDelta, rowIndices[k] - rowIndices[k - 1]);
+        return maxDelta < (1 << 8) ? 1 : (maxDelta < (1 << 16) ? 2 : 4);
+    }
+
+    /**
+     * packIndices
+     * @description encode every row of an index matrix, row sizes are computed first so rows are encoded in parallel
+     * @param indices {vector<vector<>>} the compressed index matrix
+     * @param packed {PackedIndices} the encoded matrix
+     */
+    void packIndices(const Matrix &indices, PackedIndices &packed) {
+        int nRows = indices.size();
+        vector<int> widths(nRows);
+        packed.offsets.assign(nRows + 1, 0);
+
+        #pragma omp parallel for
+        for (int row = 0; row < nRows; row++) {
+            widths[row] = packedDeltaWidth(indices[row]);
+            packed.offsets[row + 1] = PACKED_ROW_HEADER + (long)max((int)indices[row].size() - 1, 0) * widths[row];
+        }
+        for (int row = 0; row < nRows; row++) packed.offsets[row + 1] += packed.offsets[row];
+        packed.bytes.resize(packed.offsets[nRows]);
+
+        #pragma omp parallel for
+        for (int row = 0; row < nRows; row++) {
+            const Row &rowIndices = indices[row];
+            uint8_t *p = &packed.bytes[packed.offsets[row]];
+            int count = rowIndices.size();
+            int first = count > 0 ? rowIndices[0] : 0;
+            p[0] = widths[row];
+            memcpy(p + 1, &count, 4);
+            memcpy(p + 5, &first, 4);
+            p += PACKED_ROW_HEADER;
+            for (int k = 1; k < count; k++) {
+                // little-endian, so the low bytes of the delta are its narrow encoding
+                uint32_t delta = rowIndices[k] - rowIndices[k - 1];
+                memcpy(p, &delta, widths[row]);
+                p += widths[row];
+            }
+        }
+    }
+
+    void decodeDeltasScalar(const uint8_t *deltas, int width, int count, int running, int *out) {
+        for (int k = 0; k < count; k++) {
+            uint32_t delta = 0;
+            memcpy(&delta, deltas + (size_t)k * width, width);
+            running += delta;
+            out[k] = running;
+        }
+    }
+
+    /**
+     * decodeDeltasAVX2
+     * @description widen 8 deltas to 32 bits, prefix-sum them in-register and add the running index
+     */
+    __attribute__((target("avx2")))
+    void decodeDeltasAVX2(const uint8_t *deltas, int width, int count, int running, int *out) {
+        __m256i base = _mm256_set1_epi32(running);
+        int k = 0;
+        for (; k + 8 <= count; k += 8) {
+            __m256i x;
+            if (width == 1) {
+                x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(deltas + k)));
+            } else if (width == 2) {
+                x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(deltas + 2 * k)));
+            } else {
+                x = _mm256_loadu_si256((const __m256i*)(deltas + 4 * k));
+            }
+            // inclusive prefix sum within each 128-bit lane, then carry the low lane's total into the high lane
+            x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+            x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+            __m256i carry = _mm256_shuffle_epi32(x, 0xFF);
+            x = _mm256_add_epi32(x, _mm256_permute2x128_si256(carry, carry, 0x08));
+            x = _mm256_add_epi32(x, base);
+            _mm256_storeu_si256((__m256i*)(out + k), x);
+            base = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7));
+        }
+        if (k < count) decodeDeltasScalar(deltas + (size_t)k * width, width, count - k, k > 0 ? out[k - 1] : running, out + k);
+    }
+
+    /**
+     * decodeDeltas
+     * @description decode count deltas into absolute indices starting from running, using AVX2 when the CPU has it
+     */
+    void decodeDeltas(const uint8_t *deltas, int width, int count, int running, int *out) {
+        static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+        if (hasAVX2) {
+            decodeDeltasAVX2(deltas, width, count, running, out);
+        } else {
+            decodeDeltasScalar(deltas, width, count, running, out);
+        }
+    }
+
+    /**
+     * unpackIndices
+     * @description decode every row of a packed index matrix back into rows of indices
+     */
+    void unpackIndices(const PackedIndices &packed, Matrix &indices) {
+        int nRows = packed.offsets.size() - 1;
+        indices.resize(nRows);
+
+        #pragma omp parallel for
+        for (int row = 0; row < nRows; row++) {
+            const uint8_t *p = &packed.bytes[packed.offsets[row]];
+            int width = p[0], count, first;
+            memcpy(&count, p + 1, 4);
+            memcpy(&first, p + 5, 4);
+            indices[row].resize(count);
+            if (count == 0) continue;
+            indices[row][0] = first;
+            decodeDeltas(p + PACKED_ROW_HEADER, width, count - 1, first, indices[row].data() + 1);
+        }
+    }
 
     /**
      * generateMatrices
@@ -21,7 +298,7 @@
      * @param percent {int}, probability of non-zeros
      * @param suffix {string}, suffix for the fileName to distinguish matrix X and matrix Y
      */
-    void generateMatrices(vector<vector<int>> &original, vector<vector<int>> &values, vector<vector<int>> &indices, int percent, string suffix) {
+    void generateMatrices(Matrix &original, Matrix &values, Matrix &indices, int percent, string suffix) {
         if (DEBUG) cout << "Generating matrix:\n";
 
         // open two files for writing
@@ -38,7 +315,11 @@
 
         for (int row = 0; row < NROWS; row++) {
             // 1d vector for uncompressed/values/indices each row
-            vector <int> rowOriginal, rowValues, rowIndices;
+            Row rowOriginal, rowValues, rowIndices;
+            // reserve up front so push_back does not reallocate inside the arena
+            rowOriginal.reserve(NCOLS);
+            rowValues.reserve(expectedRowNonZeros(percent));
+            rowIndices.reserve(expectedRowNonZeros(percent));
             for (int col = 0; col < NCOLS; col++) {
                 // if this element falls to non-zero jackpot 
                 if (rand() % 100 < percent) {
@@ -69,9 +350,9 @@
                 fprintf(fpb," %d %d", 0, 0);
                 fprintf(fpc," %d %d", 0, 0);
             }
-            original.push_back(rowOriginal);
-            values.push_back(rowValues);
-            indices.push_back(rowIndices);
+            original.push_back(move(rowOriginal));
+            values.push_back(move(rowValues));
+            indices.push_back(move(rowIndices));
 
             // write endl into file
             fprintf(fpb, "\n");
@@ -85,7 +366,156 @@
     }
 
 
-    void loadMatrices(vector<vector<int>> &values, vector<vector<int>> &indices, int percent, string suffix) {
+    /**
+     * writePackedMatrix
+     * @description write the binary packed file: row count, nnz and packed index size, then the row offsets,
+     * @description the packed indices and the values of all rows
+     * @param values {vector<vector>>} the compressed value matrix
+     * @param packed {PackedIndices} the packed index matrix
+     * @param percent {int}, probability of non-zeros
+     * @param suffix {string}, suffix for the fileName to distinguish matrix X and matrix Y
+     */
+    void writePackedMatrix(const Matrix &values, const PackedIndices &packed, int percent, string suffix) {
+        string fileP = "FilePacked_matrix" + suffix + "_percent_" + to_string(percent);
+        FILE *fpp = fopen(fileP.c_str(), "wb");
+        if (fpp == nullptr) {
+            cerr << "Error opening files!" << endl;
+            return;
+        }
+
+        int nRows = values.size();
+        long nnz = 0;
+        for (const Row &row : values) nnz += row.size();
+        long nBytes = packed.bytes.size();
+        fwrite(&nRows, sizeof(int), 1, fpp);
+        fwrite(&nnz, sizeof(long), 1, fpp);
+        fwrite(&nBytes, sizeof(long), 1, fpp);
+        fwrite(packed.offsets.data(), sizeof(long), nRows + 1, fpp);
+        fwrite(packed.bytes.data(), 1, nBytes, fpp);
+        for (const Row &row : values) fwrite(row.data(), sizeof(int), row.size(), fpp);
+        fclose(fpp);
+    }
+
+    /**
+     * checkPackedLayout
+     * @description check the row offsets and row headers of a packed matrix against each other before anything is decoded:
+     * @description every row must hold exactly its header and count - 1 deltas of a valid width, and the counts add up to nnz
+     */
+    bool checkPackedLayout(const PackedIndices &packed, long nnz) {
+        int nRows = packed.offsets.size() - 1;
+        long nBytes = packed.bytes.size(), total = 0;
+        if (packed.offsets[0] != 0 || packed.offsets[nRows] != nBytes) return false;
+        for (int row = 0; row < nRows; row++) {
+            long rowBytes = packed.offsets[row + 1] - packed.offsets[row];
+            if (rowBytes < PACKED_ROW_HEADER || packed.offsets[row + 1] > nBytes) return false;
+            const uint8_t *p = &packed.bytes[packed.offsets[row]];
+            int width = p[0], count;
+            memcpy(&count, p + 1, 4);
+            if ((width != 1 && width != 2 && width != 4) || count < 0) return false;
+            if (rowBytes != PACKED_ROW_HEADER + (long)max(count - 1, 0) * width) return false;
+            total += count;
+        }
+        return total == nnz;
+    }
+
+    /**
+     * loadPackedMatrix
+     * @description read a binary packed file written by writePackedMatrix. The sizes in the header are checked against
+     * @description the file length and the row layout before they are used, so a truncated or corrupt file is rejected
+     * @description instead of driving huge allocations or decoding past the end of a row
+     * @return {bool} false if the file does not exist, is truncated or is inconsistent
+     */
+    bool loadPackedMatrix(Matrix &values, PackedIndices &packed, int percent, string suffix) {
+        string fileP = "FilePacked_matrix" + suffix + "_percent_" + to_string(percent);
+        FILE *fpp = fopen(fileP.c_str(), "rb");
+        if (fpp == nullptr) return false;
+        fseek(fpp, 0, SEEK_END);
+        long fileBytes = ftell(fpp);
+        rewind(fpp);
+
+        int nRows;
+        long nnz, nBytes;
+        long headerBytes = sizeof(int) + 2 * sizeof(long);
+        bool ok = fread(&nRows, sizeof(int), 1, fpp) == 1 && fread(&nnz, sizeof(long), 1, fpp) == 1 && fread(&nBytes, sizeof(long), 1, fpp) == 1;
+        // each term is bounded by the file length before they are added, so the sum cannot overflow
+        ok = ok && nRows > 0 && nRows <= NROWS && nnz >= 0 && nBytes >= 0 && nnz <= fileBytes / (long)sizeof(int) && nBytes <= fileBytes;
+        ok = ok && headerBytes + (nRows + 1) * (long)sizeof(long) + nBytes + nnz * (long)sizeof(int) == fileBytes;
+        if (ok) {
+            packed.offsets.resize(nRows + 1);
+            packed.bytes.resize(nBytes);
+            ok = fread(packed.offsets.data(), sizeof(long), nRows + 1, fpp) == nRows + 1 && fread(packed.bytes.data(), 1, nBytes, fpp) == nBytes;
+        }
+        ok = ok && checkPackedLayout(packed, nnz);
+        if (ok) {
+            values.resize(nRows);
+            for (int row = 0; ok && row < nRows; row++) {
+                // the row length is the count in the packed row header
+                int count;
+                memcpy(&count, &packed.bytes[packed.offsets[row]] + 1, 4);
+                values[row].resize(count);
+                ok = fread(values[row].data(), sizeof(int), count, fpp) == count;
+            }
+        }
+        fclose(fpp);
+        if (!ok) {
+            cerr << "Error reading " << fileP << ", falling back to the text files" << endl;
+            values.clear();
+            packed = PackedIndices();
+        }
+        return ok;
+    }
+
+    /**
+     * checkIndexRange
+     * @description every decoded index lies in [0, NCOLS) and no row goes backwards (a wrapped 4-byte delta would)
+     */
+    bool checkIndexRange(const Matrix &indices) {
+        bool ok = true;
+        #pragma omp parallel for reduction(&&:ok)
+        for (int row = 0; row < indices.size(); row++) {
+            const Row &rowIndices = indices[row];
+            for (int k = 0; k < rowIndices.size(); k++) {
+                if (rowIndices[k] < 0 || rowIndices[k] >= NCOLS || (k > 0 && rowIndices[k] < rowIndices[k - 1])) ok = false;
+            }
+        }
+        return ok;
+    }
+
+    /**
+     * readRow
+     * @description read one row of values and indices from the compressed matrix files
+     * @param fpb {FILE*} the opened FileB (values)
+     * @param fpc {FILE*} the opened FileC (indices)
+     * @param rowValues {vector<>} values of the row, appended to
+     * @param rowIndices {vector<>} indices of the row, appended to
+     * @return {bool} false once the end of the files is reached
+     */
+    bool readRow(FILE *fpb, FILE *fpc, Row &rowValues, Row &rowIndices) {
+        int value, index;
+        while (fscanf(fpb, "%d", &value) == 1 && fscanf(fpc, "%d", &index) == 1) {
+            rowValues.push_back(value);
+            rowIndices.push_back(index);
+
+            // Check if we've reached the end of the row
+            if (fgetc(fpb) == '\n' || fgetc(fpc) == '\n') {
+                break;
+            }
+        }
+        // Every row holds at least the 2-zero placeholder, so an empty row means end of file
+        return !rowValues.empty();
+    }
+
+    void loadMatrices(Matrix &values, Matrix &indices, int percent, string suffix) {
+        // Prefer the binary packed file when init or pack mode has written one
+        PackedIndices packed;
+        if (loadPackedMatrix(values, packed, percent, suffix)) {
+            unpackIndices(packed, indices);
+            if (checkIndexRange(indices)) return;
+            cerr << "Column index out of range in FilePacked_matrix" << suffix << "_percent_" << percent << ", falling back to the text files" << endl;
+            indices.clear();
+        }
+        values.clear();
+
         string fileB = "FileB_matrix" + suffix + "_percent_" + to_string(percent);
         string fileC = "FileC_matrix" + suffix + "_percent_" + to_string(percent);
 
@@ -99,28 +529,25 @@
         }
 
         // Read values from fileB and indices from fileC
-        int value, index;
         int row = 0;
-        while (!feof(fpb) && !feof(fpc)) {
-            vector<int> rowValues;
-            vector<int> rowIndices;
+        while (true) {
+            Row rowValues;
+            Row rowIndices;
+            rowValues.reserve(expectedRowNonZeros(percent));
+            rowIndices.reserve(expectedRowNonZeros(percent));
 
             // One row of values and indices
-            while (fscanf(fpb, "%d", &value) == 1 && fscanf(fpc, "%d", &index) == 1) {
-                if (DEBUG) {
-                    cout << "matrix: " << suffix << " row: " << row << " value: " << value << " index: " << index << endl;
-                }
-                rowValues.push_back(value);
-                rowIndices.push_back(index);
-
-                // Check if we've reached the end of the row
-                if (fgetc(fpb) == '\n' || fgetc(fpc) == '\n') {
-                    break;
+            if (!readRow(fpb, fpc, rowValues, rowIndices)) {
+                break;
+            }
+            if (DEBUG) {
+                for (int j = 0; j < rowValues.size(); j++) {
+                    cout << "matrix: " << suffix << " row: " << row << " value: " << rowValues[j] << " index: " << rowIndices[j] << endl;
                 }
             }
 
-            values.push_back(rowValues);
-            indices.push_back(rowIndices);
+            values.push_back(move(rowValues));
+            indices.push_back(move(rowIndices));
             row++;
         }
 
@@ -136,9 +563,9 @@
      * @param Y {vector<vector<>>} the Y matrix
      * @return {vector<vector<>>} the resulting matrix
      */
-    vector<vector<int>> matrixMultiply(vector<vector<int>> &X, vector<vector<int>> &Y) {
+    Matrix matrixMultiply(Matrix &X, Matrix &Y) {
         // Initialize resulting matrix with all zeros
-        vector<vector<int>> result(NROWS, vector<int>(NCOLS, 0));
+        Matrix result(NROWS, Row(NCOLS, 0));
 
         if (DEBUG) cout << "Ordinary matrixMultiply:\n";
         for (int i = 0; i < NROWS; i++) {
@@ -163,9 +590,9 @@
      * @param Yindices {vector<vector<>>} the Yindices matrix
      * @param NThreads {int} number of threads
      */
-    vector<vector<int>> compressedMatrixMultiply(vector<vector<int>> &Xvalues, vector<vector<int>> &Xindices, vector<vector<int>> &Yvalues, vector<vector<int>> &Yindices) {
+    Matrix compressedMatrixMultiply(Matrix &Xvalues, Matrix &Xindices, Matrix &Yvalues, Matrix &Yindices) {
         // Initialize resulting matrix with all zeros
-        vector<vector<int>> result(NROWS, vector<int>(NCOLS, 0));
+        Matrix result(NROWS, Row(NCOLS, 0));
 
         if (DEBUG) cout << "Compressed matrixMultiply:\n";
         #pragma omp parallel for
@@ -197,11 +624,584 @@
         return result;
     }
 
+    /**
+     * detectTileCols
+     * @description pick a panel width so that one panel of a result row fits in half of the L2 cache
+     * @return {int} number of columns per panel
+     */
+    int detectTileCols() {
+        long cacheBytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        // fallback when the OS does not report the L2 size
+        if (cacheBytes <= 0) cacheBytes = 256 * 1024;
+        long tileCols = cacheBytes / 2 / sizeof(int);
+        return (int)min(max(tileCols, (long)TILE_MIN_COLS), (long)NCOLS);
+    }
+
+    /**
+     * clampTileCols
+     * @description the panel width actually used for a requested one: the L2-sized default for 0, otherwise at least
+     * @description TILE_MIN_COLS (the bounds table holds NCOLS / tileCols entries per row of Y) and at most NCOLS
+     */
+    int clampTileCols(int tileCols) {
+        if (tileCols <= 0) return detectTileCols();
+        return min(max(tileCols, TILE_MIN_COLS), NCOLS);
+    }
+
+    /**
+     * buildPanelBounds
+     * @description precompute where every row of Y crosses a panel boundary (indices are sorted within a row)
+     * @param Yindices {vector<vector<>>} the Yindices matrix
+     * @param tileCols {int} number of columns per panel
+     * @return {vector<vector<>>} bounds[row][p] to bounds[row][p + 1] is the slice of the row inside panel p
+     */
+    Matrix buildPanelBounds(Matrix &Yindices, int tileCols) {
+        int nPanels = (NCOLS + tileCols - 1) / tileCols;
+        Matrix bounds(Yindices.size(), Row(nPanels + 1));
+
+        #pragma omp parallel for
+        for (int row = 0; row < Yindices.size(); row++) {
+            const Row &rowIndices = Yindices[row];
+            for (int p = 0; p <= nPanels; p++) {
+                bounds[row][p] = lower_bound(rowIndices.begin(), rowIndices.end(), p * tileCols) - rowIndices.begin();
+            }
+        }
+        return bounds;
+    }
+
+    /**
+     * tiledCompressedMatrixMultiply
+     * @description The compressed matrix multiply split into column panels of Y, so the part of the
+     * @description result row being accumulated stays in L1/L2 instead of spanning all NCOLS
+     * @param Xvalues {vector<vector<>>} the Xvalues matrix
+     * @param Xindices {vector<vector<>>} the Xindices matrix
+     * @param Yvalues {vector<vector<>>} the Yvalues matrix
+     * @param Yindices {vector<vector<>>} the Yindices matrix
+     * @param tileCols {int} number of columns per panel, 0 to size it from the L2 cache, clamped to TILE_MIN_COLS..NCOLS
+     */
+    Matrix tiledCompressedMatrixMultiply(Matrix &Xvalues, Matrix &Xindices, Matrix &Yvalues, Matrix &Yindices, int tileCols) {
+        // Initialize resulting matrix with all zeros
+        Matrix result(NROWS, Row(NCOLS, 0));
+
+        tileCols = clampTileCols(tileCols);
+        int nPanels = (NCOLS + tileCols - 1) / tileCols;
+        Matrix bounds = buildPanelBounds(Yindices, tileCols);
+
+        if (DEBUG) cout << "Tiled matrixMultiply with " << nPanels << " panels of " << tileCols << " columns:\n";
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < Xvalues.size(); i++) {
+            if (Xvalues[i].empty()) continue;
+
+            // Each row belongs to exactly one thread, so no atomics are needed
+            int *resultRow = result[i].data();
+            for (int p = 0; p < nPanels; p++) {
+                for (int j = 0; j < Xvalues[i].size(); j++) {
+                    int X_value = Xvalues[i][j];
+                    int X_indice = Xindices[i][j];
+
+                    // Only the slice of row X_indice of Y that falls into panel p
+                    const int *Y_values = Yvalues[X_indice].data();
+                    const int *Y_indices = Yindices[X_indice].data();
+                    for (int k = bounds[X_indice][p]; k < bounds[X_indice][p + 1]; k++) {
+                        resultRow[Y_indices[k]] += X_value * Y_values[k];
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * packedCompressedMatrixMultiply
+     * @description The compressed matrix multiply reading Y's column indices in packed form, each row of Y is
+     * @description decoded a chunk at a time right before the chunk is scattered into the result row
+     * @param Xvalues {vector<vector<>>} the Xvalues matrix
+     * @param Xindices {vector<vector<>>} the Xindices matrix
+     * @param Yvalues {vector<vector<>>} the Yvalues matrix
+     * @param packedY {PackedIndices} the packed Yindices matrix
+     */
+    Matrix packedCompressedMatrixMultiply(Matrix &Xvalues, Matrix &Xindices, Matrix &Yvalues, const PackedIndices &packedY) {
+        // Initialize resulting matrix with all zeros
+        Matrix result(NROWS, Row(NCOLS, 0));
+
+        if (DEBUG) cout << "Packed matrixMultiply:\n";
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < Xvalues.size(); i++) {
+            if (Xvalues[i].empty()) continue;
+
+            // Each row belongs to exactly one thread, so no atomics are needed
+            int *resultRow = result[i].data();
+            int Y_indices[PACKED_CHUNK];
+            for (int j = 0; j < Xvalues[i].size(); j++) {
+                int X_value = Xvalues[i][j];
+                int X_indice = Xindices[i][j];
+
+                const uint8_t *p = &packedY.bytes[packedY.offsets[X_indice]];
+                int width = p[0], count, running;
+                memcpy(&count, p + 1, 4);
+                memcpy(&running, p + 5, 4);
+                if (count == 0) continue;
+
+                const int *Y_values = Yvalues[X_indice].data();
+                resultRow[running] += X_value * Y_values[0];
+                for (int k = 1; k < count; k += PACKED_CHUNK) {
+                    int chunk = min(PACKED_CHUNK, count - k);
+                    decodeDeltas(p + PACKED_ROW_HEADER + (size_t)(k - 1) * width, width, chunk, running, Y_indices);
+                    for (int c = 0; c < chunk; c++) {
+                        resultRow[Y_indices[c]] += X_value * Y_values[k + c];
+                    }
+                    running = Y_indices[chunk - 1];
+                }
+            }
+        }
+        return result;
+    }
+
+    #define ESC_SMALL_ROW 32 // Expanded rows up to this length are insertion sorted
+
+    /**
+     * escSortRow
+     * @description sort the expanded products of one row by column. A product is packed as column << 32 | value,
+     * @description so short rows are insertion sorted, mid-sized rows go to std::sort and long rows get a two-pass
+     * @description LSD radix sort on the column bits
+     * @param expanded {vector<uint64_t>} the products, sorted in place
+     * @param scratch {vector<uint64_t>} second buffer for the radix passes
+     * @param counts {vector<int>} (1 << digitBits) + 1 counters
+     * @param digitBits {int} bits per radix digit, two digits cover every column
+     */
+    void escSortRow(vector<uint64_t> &expanded, vector<uint64_t> &scratch, vector<int> &counts, int digitBits) {
+        int n = expanded.size();
+        int buckets = 1 << digitBits;
+        if (n <= ESC_SMALL_ROW) {
+            for (int k = 1; k < n; k++) {
+                uint64_t item = expanded[k];
+                int j = k - 1;
+                while (j >= 0 && expanded[j] > item) {
+                    expanded[j + 1] = expanded[j];
+                    j--;
+                }
+                expanded[j + 1] = item;
+            }
+            return;
+        }
+        if (n < 4 * buckets) {
+            // clearing the counters would cost more than comparing
+            sort(expanded.begin(), expanded.end());
+            return;
+        }
+
+        scratch.resize(n);
+        uint64_t *src = expanded.data(), *dst = scratch.data();
+        for (int shift = 32; shift < 32 + 2 * digitBits; shift += digitBits) {
+            fill(counts.begin(), counts.end(), 0);
+            for (int k = 0; k < n; k++) counts[((src[k] >> shift) & (buckets - 1)) + 1]++;
+            for (int d = 0; d < buckets; d++) counts[d + 1] += counts[d];
+            for (int k = 0; k < n; k++) dst[counts[(src[k] >> shift) & (buckets - 1)]++] = src[k];
+            swap(src, dst);
+        }
+        // an even number of passes leaves the result back in expanded
+    }
+
+    /**
+     * escMatrixMultiply
+     * @description expand-sort-compress matrix multiply: the products of each row of X are expanded into
+     * @description (column, value) pairs, sorted by column and duplicates summed, giving compressed result rows with
+     * @description sorted indices directly. Work follows the number of products instead of NCOLS per row,
+     * @description which pays off for very sparse inputs where most result rows are short
+     * @param resultValues {Matrix} values of the result, one compressed row per row of X
+     * @param resultIndices {Matrix} column indices of the result, sorted within each row
+     */
+    void escMatrixMultiply(Matrix &Xvalues, Matrix &Xindices, Matrix &Yvalues, Matrix &Yindices, Matrix &resultValues, Matrix &resultIndices) {
+        resultValues.assign(Xvalues.size(), Row());
+        resultIndices.assign(Xvalues.size(), Row());
+        int colBits = 1;
+        while ((1 << colBits) < NCOLS) colBits++;
+        int digitBits = (colBits + 1) / 2;
+
+        if (DEBUG) cout << "ESC matrixMultiply:\n";
+        #pragma omp parallel
+        {
+            vector<uint64_t> expanded, scratch;
+            vector<int> counts((1 << digitBits) + 1);
+            #pragma omp for schedule(dynamic, 64)
+            for (int i = 0; i < Xvalues.size(); i++) {
+                // Expand
+                expanded.clear();
+                for (int j = 0; j < Xvalues[i].size(); j++) {
+                    int X_value = Xvalues[i][j];
+                    int X_indice = Xindices[i][j];
+                    for (int k = 0; k < Yvalues[X_indice].size(); k++) {
+                        uint32_t product = (uint32_t)(X_value * Yvalues[X_indice][k]);
+                        expanded.push_back(((uint64_t)Yindices[X_indice][k] << 32) | product);
+                    }
+                }
+
+                // Sort
+                escSortRow(expanded, scratch, counts, digitBits);
+
+                // Compress, sizing the rows first so the arena is not left with outgrown copies
+                int distinct = 0;
+                for (int k = 0; k < expanded.size(); k++) {
+                    if (k == 0 || (expanded[k] >> 32) != (expanded[k - 1] >> 32)) distinct++;
+                }
+                Row &rowValues = resultValues[i], &rowIndices = resultIndices[i];
+                rowValues.reserve(distinct);
+                rowIndices.reserve(distinct);
+                for (int k = 0; k < expanded.size(); ) {
+                    int col = expanded[k] >> 32;
+                    int sum = 0;
+                    while (k < expanded.size() && (int)(expanded[k] >> 32) == col) sum += (int)(uint32_t)expanded[k++];
+                    if (sum != 0) {
+                        rowValues.push_back(sum);
+                        rowIndices.push_back(col);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * BoundedQueue
+     * @description fixed-capacity lock-free multi-producer multi-consumer queue (sequence-numbered ring buffer)
+     */
+    template <typename T>
+    class BoundedQueue {
+    public:
+        BoundedQueue(size_t capacity) : head(0), tail(0) {
+            // round capacity up to a power of two so positions wrap with a mask
+            size_t size = 2;
+            while (size < capacity) size *= 2;
+            cells = vector<Cell>(size);
+            mask = size - 1;
+            for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, memory_order_relaxed);
+        }
+
+        bool tryPush(const T &item) {
+            size_t pos = tail.load(memory_order_relaxed);
+            while (true) {
+                Cell &cell = cells[pos & mask];
+                long diff = (long)cell.sequence.load(memory_order_acquire) - (long)pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        cell.data = item;
+                        cell.sequence.store(pos + 1, memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false; // full
+                } else {
+                    pos = tail.load(memory_order_relaxed);
+                }
+            }
+        }
+
+        bool tryPop(T &item) {
+            size_t pos = head.load(memory_order_relaxed);
+            while (true) {
+                Cell &cell = cells[pos & mask];
+                long diff = (long)cell.sequence.load(memory_order_acquire) - (long)(pos + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        item = cell.data;
+                        cell.sequence.store(pos + mask + 1, memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false; // empty
+                } else {
+                    pos = head.load(memory_order_relaxed);
+                }
+            }
+        }
+
+        // Blocking variants, a thread finding the queue full or empty sleeps until the other side moves
+        void push(const T &item) {
+            if (!tryPush(item)) wait(notFull, pushWaiters, [&]() { return tryPush(item); });
+            wake(notEmpty, popWaiters);
+        }
+        T pop() {
+            T item;
+            if (!tryPop(item)) wait(notEmpty, popWaiters, [&]() { return tryPop(item); });
+            wake(notFull, pushWaiters);
+            return item;
+        }
+
+    private:
+        template <typename Ready>
+        void wait(condition_variable &cv, atomic<int> &waiters, Ready ready) {
+            unique_lock<mutex> lock(waitMutex);
+            waiters++;
+            atomic_thread_fence(memory_order_seq_cst);
+            cv.wait(lock, ready);
+            waiters--;
+        }
+
+        // The lock is only taken when someone sleeps, it orders the notify after the sleeper's last check
+        void wake(condition_variable &cv, atomic<int> &waiters) {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (waiters.load() == 0) return;
+            { lock_guard<mutex> lock(waitMutex); }
+            cv.notify_one();
+        }
+
+        struct Cell {
+            atomic<size_t> sequence;
+            T data;
+        };
+        vector<Cell> cells;
+        size_t mask;
+        alignas(64) atomic<size_t> head;
+        alignas(64) atomic<size_t> tail;
+        mutex waitMutex;
+        condition_variable notEmpty, notFull;
+        atomic<int> pushWaiters{0}, popWaiters{0};
+    };
+
+    /**
+     * RowBlock
+     * @description a block of consecutive rows travelling through the pipeline, the loader fills
+     * @description values/indices with rows of X and the multiply stage replaces them with formatted result rows
+     */
+    struct RowBlock {
+        int firstRow;
+        int nRows;
+        Matrix values, indices;
+        string outB, outC;
+    };
+
+    /**
+     * multiplyRowSparse
+     * @description multiply one compressed row of X with Y into a compressed result row (sorted indices)
+     * @param accumulator {vector<int>} dense scratch row of NCOLS zeros, left zeroed on return
+     * @param marker {vector<int>} per-column stamp of the last row that touched it
+     * @param touched {vector<int>} scratch list of the columns touched by this row
+     * @param stamp {int} unique id of this row for the marker
+     */
+    void multiplyRowSparse(const Row &rowValues, const Row &rowIndices, Matrix &Yvalues, Matrix &Yindices,
+                           vector<int> &accumulator, vector<int> &marker, vector<int> &touched, int stamp,
+                           Row &resultValues, Row &resultIndices) {
+        touched.clear();
+        for (int j = 0; j < rowValues.size(); j++) {
+            int X_value = rowValues[j];
+            int X_indice = rowIndices[j];
+            for (int k = 0; k < Yvalues[X_indice].size(); k++) {
+                int Y_indice = Yindices[X_indice][k];
+                if (marker[Y_indice] != stamp) {
+                    marker[Y_indice] = stamp;
+                    touched.push_back(Y_indice);
+                }
+                accumulator[Y_indice] += X_value * Yvalues[X_indice][k];
+            }
+        }
+
+        sort(touched.begin(), touched.end());
+        resultValues.clear();
+        resultIndices.clear();
+        for (int col : touched) {
+            if (accumulator[col] != 0) {
+                resultValues.push_back(accumulator[col]);
+                resultIndices.push_back(col);
+            }
+            accumulator[col] = 0;
+        }
+    }
+
+    /**
+     * runPipeline
+     * @description load X, multiply and write the result as concurrent stages over blocks of rows, connected by
+     * @description bounded lock-free queues. Y is loaded first since any row of X may reference any row of Y.
+     * @description The result is written in the same format as the inputs to FileB/FileC_matrixXY_percent_N
+     * @param percent {int} probability of non-zeros, selects the input files
+     * @param nThreads {int} thread budget, split into 1 loader, 1 writer and the rest multiplying. With fewer than
+     * @param nThreads 3 threads there are no stage threads, every thread loads, multiplies and writes its own blocks
+     * @param blockRows {int} number of rows per block
+     */
+    void runPipeline(int percent, int nThreads, int blockRows) {
+        bool staged = nThreads >= 3;
+        int nWorkers = staged ? nThreads - 2 : max(1, nThreads);
+        // Blocks allowed between the loader and the writer, bounds the memory held by the pipeline
+        int maxInFlight = 4 * nWorkers;
+
+        double start = omp_get_wtime();
+        Matrix Yvalues, Yindices;
+        loadMatrices(Yvalues, Yindices, percent, "Y");
+        double yLoaded = omp_get_wtime();
+        if (staged) {
+            cout << "Y loaded in " << (yLoaded - start) << "s, streaming X with 1 loader, " << nWorkers << " multiply and 1 writer threads" << endl;
+        } else {
+            cout << "Y loaded in " << (yLoaded - start) << "s, streaming X with " << nWorkers << " threads each loading, multiplying and writing" << endl;
+        }
+
+        FILE *inB = fopen(("FileB_matrixX_percent_" + to_string(percent)).c_str(), "r");
+        FILE *inC = fopen(("FileC_matrixX_percent_" + to_string(percent)).c_str(), "r");
+        FILE *outB = fopen(("FileB_matrixXY_percent_" + to_string(percent)).c_str(), "w");
+        FILE *outC = fopen(("FileC_matrixXY_percent_" + to_string(percent)).c_str(), "w");
+        if (inB == nullptr || inC == nullptr || outB == nullptr || outC == nullptr) {
+            cerr << "Error opening files!" << endl;
+            for (FILE *fp : {inB, inC, outB, outC}) if (fp != nullptr) fclose(fp);
+            return;
+        }
+
+        BoundedQueue<RowBlock*> loadQueue(2 * nWorkers), writeQueue(2 * nWorkers);
+        atomic<int> activeWorkers(nWorkers);
+        double loadBusy = 0, writeBusy = 0;
+        vector<double> multiplyBusy(nWorkers, 0);
+
+        // The loader sleeps while maxInFlight blocks are waiting to be written
+        mutex inFlightMutex;
+        condition_variable inFlightDone;
+        int inFlight = 0;
+
+        // Reads the next block of X, nullptr at the end of the files. One caller at a time
+        int nextLoadRow = 0;
+        auto loadBlock = [&]() -> RowBlock* {
+            double t0 = omp_get_wtime();
+            RowBlock *block = new RowBlock();
+            block->firstRow = nextLoadRow;
+            block->values.resize(blockRows);
+            block->indices.resize(blockRows);
+            int n = 0;
+            while (n < blockRows && readRow(inB, inC, block->values[n], block->indices[n])) n++;
+            block->nRows = n;
+            loadBusy += omp_get_wtime() - t0;
+
+            if (n == 0) {
+                delete block;
+                return nullptr;
+            }
+            nextLoadRow += n;
+            return block;
+        };
+
+        // Replaces the rows of X in a block with its formatted result rows
+        auto multiplyBlock = [&](RowBlock *block, vector<int> &accumulator, vector<int> &marker, vector<int> &touched,
+                                 Row &resultValues, Row &resultIndices) {
+            for (int r = 0; r < block->nRows; r++) {
+                multiplyRowSparse(block->values[r], block->indices[r], Yvalues, Yindices,
+                                  accumulator, marker, touched, block->firstRow + r, resultValues, resultIndices);
+
+                // edge case: if no non-zeros in a row, fill 2-consecutive zeros on position 0-1 for indication
+                if (resultIndices.empty()) {
+                    resultValues.assign(2, 0);
+                    resultIndices.assign(2, 0);
+                }
+                for (int j = 0; j < resultValues.size(); j++) {
+                    block->outB += " " + to_string(resultValues[j]);
+                    block->outC += " " + to_string(resultIndices[j]);
+                }
+                block->outB += "\n";
+                block->outC += "\n";
+            }
+            // Input rows are no longer needed once the block is formatted
+            Matrix().swap(block->values);
+            Matrix().swap(block->indices);
+        };
+
+        // Blocks may finish out of order, they are held until their turn comes. One caller at a time
+        map<int, RowBlock*> pending;
+        int nextWriteRow = 0;
+        auto writeBlock = [&](RowBlock *block) {
+            double t0 = omp_get_wtime();
+            pending[block->firstRow] = block;
+            while (!pending.empty() && pending.begin()->first == nextWriteRow) {
+                RowBlock *ready = pending.begin()->second;
+                fwrite(ready->outB.data(), 1, ready->outB.size(), outB);
+                fwrite(ready->outC.data(), 1, ready->outC.size(), outC);
+                nextWriteRow += ready->nRows;
+                pending.erase(pending.begin());
+                delete ready;
+                {
+                    lock_guard<mutex> lock(inFlightMutex);
+                    inFlight--;
+                }
+                inFlightDone.notify_one();
+            }
+            writeBusy += omp_get_wtime() - t0;
+        };
+
+        vector<thread> threads;
+        mutex loadMutex, writeMutex;
+        if (staged) {
+            threads.emplace_back([&]() {
+                while (true) {
+                    {
+                        unique_lock<mutex> lock(inFlightMutex);
+                        inFlightDone.wait(lock, [&]() { return inFlight < maxInFlight; });
+                        inFlight++;
+                    }
+                    RowBlock *block = loadBlock();
+                    if (block == nullptr) break;
+                    loadQueue.push(block);
+                }
+                // One end-of-stream marker per multiply worker
+                for (int w = 0; w < nWorkers; w++) loadQueue.push(nullptr);
+            });
+
+            for (int w = 0; w < nWorkers; w++) {
+                threads.emplace_back([&, w]() {
+                    vector<int> accumulator(NCOLS, 0), marker(NCOLS, -1), touched;
+                    Row resultValues, resultIndices;
+                    RowBlock *block;
+                    while ((block = loadQueue.pop()) != nullptr) {
+                        double t0 = omp_get_wtime();
+                        multiplyBlock(block, accumulator, marker, touched, resultValues, resultIndices);
+                        multiplyBusy[w] += omp_get_wtime() - t0;
+                        writeQueue.push(block);
+                    }
+                    // The last worker to finish closes the writer's stream
+                    if (--activeWorkers == 0) writeQueue.push(nullptr);
+                });
+            }
+
+            threads.emplace_back([&]() {
+                RowBlock *block;
+                while ((block = writeQueue.pop()) != nullptr) writeBlock(block);
+            });
+        } else {
+            // Loading and writing take turns under a lock, a thread holds at most one block at a time
+            for (int w = 0; w < nWorkers; w++) {
+                threads.emplace_back([&, w]() {
+                    vector<int> accumulator(NCOLS, 0), marker(NCOLS, -1), touched;
+                    Row resultValues, resultIndices;
+                    while (true) {
+                        RowBlock *block;
+                        {
+                            lock_guard<mutex> lock(loadMutex);
+                            block = loadBlock();
+                        }
+                        if (block == nullptr) break;
+                        {
+                            lock_guard<mutex> lock(inFlightMutex);
+                            inFlight++;
+                        }
+                        double t0 = omp_get_wtime();
+                        multiplyBlock(block, accumulator, marker, touched, resultValues, resultIndices);
+                        multiplyBusy[w] += omp_get_wtime() - t0;
+                        lock_guard<mutex> lock(writeMutex);
+                        writeBlock(block);
+                    }
+                });
+            }
+        }
+        for (thread &t : threads) t.join();
+        double end = omp_get_wtime();
+        for (FILE *fp : {inB, inC, outB, outC}) fclose(fp);
+
+        double multiplyBusyPerWorker = 0;
+        for (double busy : multiplyBusy) multiplyBusyPerWorker += busy / nWorkers;
+
+        auto now = std::chrono::system_clock::now();
+        time_t end_time = std::chrono::system_clock::to_time_t(now);
+        cout << "Load stage busy: " << loadBusy << "s" << endl;
+        cout << "Multiply stage busy: " << multiplyBusyPerWorker << "s per worker" << endl;
+        cout << "Write stage busy: " << writeBusy << "s" << endl;
+        cout << "Finished at " << ctime(&end_time) << "Elapsed time: " << (end - start) << "s\n";
+    }
+
     /**
      * checkIntegrity
      * @description check if compressedMatrixMultiply has the same output as ordinary matrixMultiply
      */
-    bool checkIntegrity(vector<vector<int>> source, vector<vector<int>> target) {
+    bool checkIntegrity(Matrix source, Matrix target) {
         if (source.size() != target.size()) {
             return false;
         }
@@ -222,21 +1222,359 @@
         return true;
     }
 
+    /**
+     * checkCompressedIntegrity
+     * @description check if a compressed result (as produced by escMatrixMultiply) holds the non-zeros of a dense result
+     */
+    bool checkCompressedIntegrity(const Matrix &dense, const Matrix &values, const Matrix &indices) {
+        if (dense.size() != values.size() || values.size() != indices.size()) {
+            return false;
+        }
+
+        for (int i = 0; i < dense.size(); i++) {
+            long nonZeros = dense[i].size() - count(dense[i].begin(), dense[i].end(), 0);
+            if (nonZeros != values[i].size() || values[i].size() != indices[i].size()) {
+                return false;
+            }
+
+            for (int j = 0; j < values[i].size(); j++) {
+                if (dense[i][indices[i][j]] != values[i][j] || (j > 0 && indices[i][j] <= indices[i][j - 1])) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * ResidentMatrix
+     * @description a compressed matrix (loaded or produced by a request) kept in memory by the service
+     */
+    struct ResidentMatrix {
+        Matrix values, indices;
+        long nnz;
+    };
+
+    /**
+     * ServiceState
+     * @description everything the service keeps resident between requests
+     */
+    struct ServiceState {
+        map<string, ResidentMatrix> matrices;
+        map<string, vector<long>> vectors;
+        int nextHandle = 1;
+        bool running = true;
+    };
+
+    long countNonZeros(const Matrix &values) {
+        long nnz = 0;
+        for (const Row &row : values) nnz += row.size();
+        return nnz;
+    }
+
+    /**
+     * sparseMatrixMultiply
+     * @description multiply two compressed matrices into a compressed result, one dense accumulator per thread
+     */
+    void sparseMatrixMultiply(Matrix &Xvalues, Matrix &Xindices, Matrix &Yvalues, Matrix &Yindices,
+                              Matrix &resultValues, Matrix &resultIndices) {
+        resultValues.assign(Xvalues.size(), Row());
+        resultIndices.assign(Xvalues.size(), Row());
+
+        #pragma omp parallel
+        {
+            vector<int> accumulator(NCOLS, 0), marker(NCOLS, -1), touched;
+            #pragma omp for schedule(dynamic, 64)
+            for (int i = 0; i < Xvalues.size(); i++) {
+                multiplyRowSparse(Xvalues[i], Xindices[i], Yvalues, Yindices, accumulator, marker, touched, i, resultValues[i], resultIndices[i]);
+            }
+        }
+    }
+
+    // Kernels selectable by name in start mode and in the service's bench request
+    bool isKernel(const string &kernel) {
+        return kernel == "compressed" || kernel == "tiled" || kernel == "packed" || kernel == "esc";
+    }
+
+    /**
+     * parseThreadRange
+     * @description parse a thread range such as "1-8" or a single count such as "4"
+     * @return {bool} false unless both ends are whole numbers with 1 <= minThreads <= maxThreads
+     */
+    bool parseThreadRange(const string &range, int &minThreads, int &maxThreads) {
+        size_t dash = range.find('-');
+        string ends[2] = {range.substr(0, dash), dash == string::npos ? range : range.substr(dash + 1)};
+        long parsed[2];
+        for (int e = 0; e < 2; e++) {
+            char *end;
+            errno = 0;
+            parsed[e] = strtol(ends[e].c_str(), &end, 10);
+            if (ends[e].empty() || *end != '\0' || errno != 0 || parsed[e] < 1 || parsed[e] > 1 << 20) return false;
+        }
+        minThreads = parsed[0];
+        maxThreads = parsed[1];
+        return minThreads <= maxThreads;
+    }
+
+    /**
+     * handleRequest
+     * @description run one service request against the resident matrices
+     * @param request {string} one line, e.g. "multiply X1 Y1 16" (see README for the full list)
+     * @param state {ServiceState} the resident matrices, vectors and results
+     * @return {string} the reply, first word is "ok" or "error"
+     */
+    string handleRequest(const string &request, ServiceState &state) {
+        istringstream in(request);
+        ostringstream out;
+        string command;
+        in >> command;
+
+        if (command == "load") {
+            // load <name> <X | Y> <percent>
+            string name, suffix;
+            int percent;
+            if (!(in >> name >> suffix >> percent)) return "error usage: load <name> <X | Y> <percent>\n";
+            ResidentMatrix matrix;
+            double start = omp_get_wtime();
+            loadMatrices(matrix.values, matrix.indices, percent, suffix);
+            double end = omp_get_wtime();
+            if (matrix.values.empty()) return "error could not load matrix " + suffix + " with percent " + to_string(percent) + "\n";
+            matrix.nnz = countNonZeros(matrix.values);
+            out << "ok " << name << " rows: " << matrix.values.size() << " nnz: " << matrix.nnz << " load time: " << (end - start) << "s\n";
+            state.matrices[name] = move(matrix);
+        } else if (command == "multiply") {
+            // multiply <X> <Y> <num_of_threads>, the compressed result stays resident as a new matrix
+            string nameX, nameY;
+            int nThreads;
+            if (!(in >> nameX >> nameY >> nThreads) || nThreads < 1) return "error usage: multiply <X> <Y> <num_of_threads>\n";
+            if (!state.matrices.count(nameX) || !state.matrices.count(nameY)) return "error unknown matrix\n";
+            ResidentMatrix &X = state.matrices[nameX];
+            ResidentMatrix &Y = state.matrices[nameY];
+            ResidentMatrix result;
+            omp_set_num_threads(nThreads);
+            double start = omp_get_wtime();
+            sparseMatrixMultiply(X.values, X.indices, Y.values, Y.indices, result.values, result.indices);
+            double end = omp_get_wtime();
+            result.nnz = countNonZeros(result.values);
+            string handle = "r" + to_string(state.nextHandle++);
+            out << "ok " << handle << " rows: " << result.values.size() << " nnz: " << result.nnz << " elapsed time: " << (end - start) << "s\n";
+            state.matrices[handle] = move(result);
+        } else if (command == "spmv") {
+            // spmv <X> <num_of_threads>, multiplies with a vector of ones and keeps the result vector
+            string nameX;
+            int nThreads;
+            if (!(in >> nameX >> nThreads) || nThreads < 1) return "error usage: spmv <X> <num_of_threads>\n";
+            if (!state.matrices.count(nameX)) return "error unknown matrix\n";
+            ResidentMatrix &X = state.matrices[nameX];
+            vector<long> y(X.values.size(), 0);
+            long checksum = 0;
+            omp_set_num_threads(nThreads);
+            double start = omp_get_wtime();
+            #pragma omp parallel for schedule(dynamic, 256) reduction(+:checksum)
+            for (int i = 0; i < X.values.size(); i++) {
+                long sum = 0;
+                for (int j = 0; j < X.values[i].size(); j++) sum += X.values[i][j];
+                y[i] = sum;
+                checksum += sum;
+            }
+            double end = omp_get_wtime();
+            string handle = "v" + to_string(state.nextHandle++);
+            out << "ok " << handle << " rows: " << y.size() << " checksum: " << checksum << " elapsed time: " << (end - start) << "s\n";
+            state.vectors[handle] = move(y);
+        } else if (command == "bench") {
+            // bench <X> <Y> <thread_range> [kernel: compressed | tiled | packed | esc] [tileCols (0 = auto)], results are discarded
+            string nameX, nameY, range, kernel = "compressed";
+            int tileCols = 0;
+            int minThreads, maxThreads;
+            if (!(in >> nameX >> nameY >> range) || !parseThreadRange(range, minThreads, maxThreads)) {
+                return "error usage: bench <X> <Y> <thread_range> [kernel] [tileCols]\n";
+            }
+            in >> kernel >> tileCols;
+            if (!isKernel(kernel)) return "error unknown kernel " + kernel + "\n";
+            if (tileCols < 0) return "error tileCols must be 0 (auto) or positive\n";
+            if (!state.matrices.count(nameX) || !state.matrices.count(nameY)) return "error unknown matrix\n";
+            ResidentMatrix &X = state.matrices[nameX];
+            ResidentMatrix &Y = state.matrices[nameY];
+            PackedIndices packedY;
+            if (kernel == "packed") packIndices(Y.indices, packedY);
+            out << "ok bench " << kernel << "\n";
+            for (int num_threads = minThreads; num_threads <= maxThreads; num_threads++) {
+                omp_set_num_threads(num_threads);
+                double start = omp_get_wtime();
+                if (kernel == "tiled") {
+                    tiledCompressedMatrixMultiply(X.values, X.indices, Y.values, Y.indices, tileCols);
+                } else if (kernel == "packed") {
+                    packedCompressedMatrixMultiply(X.values, X.indices, Y.values, packedY);
+                } else if (kernel == "esc") {
+                    Matrix resultValues, resultIndices;
+                    escMatrixMultiply(X.values, X.indices, Y.values, Y.indices, resultValues, resultIndices);
+                } else {
+                    compressedMatrixMultiply(X.values, X.indices, Y.values, Y.indices);
+                }
+                double end = omp_get_wtime();
+                out << "threads: " << num_threads << " elapsed time: " << (end - start) << "s\n";
+            }
+        } else if (command == "list") {
+            out << "ok " << state.matrices.size() << " matrices, " << state.vectors.size() << " vectors\n";
+            for (auto &entry : state.matrices) out << entry.first << " rows: " << entry.second.values.size() << " nnz: " << entry.second.nnz << "\n";
+            for (auto &entry : state.vectors) out << entry.first << " rows: " << entry.second.size() << "\n";
+        } else if (command == "drop") {
+            string name;
+            in >> name;
+            if (!state.matrices.erase(name) && !state.vectors.erase(name)) return "error unknown handle\n";
+            out << "ok dropped " << name << "\n";
+        } else if (command == "shutdown") {
+            state.running = false;
+            out << "ok shutting down\n";
+        } else {
+            out << "error unknown request: " << command << "\n";
+        }
+        return out.str();
+    }
+
+    /**
+     * runService
+     * @description keep matrices resident and answer one request per connection on a Unix domain socket
+     * @param socketPath {string} filesystem path of the socket
+     */
+    void runService(const string &socketPath) {
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (server < 0 || socketPath.size() >= sizeof(address.sun_path)) {
+            cerr << "Error creating socket!" << endl;
+            return;
+        }
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        unlink(socketPath.c_str());
+        if (bind(server, (sockaddr*)&address, sizeof(address)) < 0 || listen(server, 8) < 0) {
+            cerr << "Error binding socket " << socketPath << "!" << endl;
+            close(server);
+            return;
+        }
+        cout << "Service listening on " << socketPath << endl;
+
+        ServiceState state;
+        while (state.running) {
+            int client = accept(server, nullptr, nullptr);
+            if (client < 0) continue;
+
+            // A request is a single line, the client closes its side after sending it
+            string request;
+            char buffer[4096];
+            ssize_t n;
+            while (request.find('\n') == string::npos && (n = read(client, buffer, sizeof(buffer))) > 0) {
+                request.append(buffer, n);
+            }
+            request = request.substr(0, request.find('\n'));
+
+            cout << "Request: " << request << endl;
+            string reply;
+            try {
+                reply = handleRequest(request, state);
+            } catch (const exception &e) {
+                // A failed request must not take the resident matrices down with it
+                reply = string("error ") + e.what() + "\n";
+            }
+            cout << reply;
+
+            // MSG_NOSIGNAL: a client that already hung up gives EPIPE instead of killing the service with SIGPIPE
+            for (size_t sent = 0; sent < reply.size(); ) {
+                n = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    cerr << "Client went away, dropping its reply" << endl;
+                    break;
+                }
+                sent += n;
+            }
+            close(client);
+        }
+        close(server);
+        unlink(socketPath.c_str());
+    }
+
+    /**
+     * runClient
+     * @description send one request to a running service and print its reply
+     * @return {int} exit code, 1 if the service could not be reached or replied with an error
+     */
+    int runClient(const string &socketPath, const string &request) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+            cerr << "Error connecting to " << socketPath << "!" << endl;
+            return 1;
+        }
+        string line = request + "\n";
+        if (write(fd, line.data(), line.size()) < 0) {
+            cerr << "Error sending request!" << endl;
+            close(fd);
+            return 1;
+        }
+        shutdown(fd, SHUT_WR);
+
+        string reply;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) reply.append(buffer, n);
+        close(fd);
+        cout << reply;
+        return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
+
     int main(int argc, char *argv[]) {
         int percent = 0, minThreads = 0, maxThreads = 0;
         if (argc < 3) {
-            cout << "Usage: %s [init | start] [percent | thread_range] [percent (if mode set to start)]\n" << endl;
+            cout << "Usage: %s [init | start | pack | pipeline | serve | client | bench] [percent | thread_range | num_of_threads | socket] [percent (if mode set to start or pipeline) | percents, e.g. 1,2,5 (if mode set to bench)] [kernel: compressed | tiled | packed | esc | blockRows (if mode set to pipeline)] [tileCols (0 = auto)]\n" << endl;
             return 1;
         }
         string mode = argv[1];
         string param1 = argv[2];
+        if (mode == "client") {
+            // client <socket> <request...>
+            string request;
+            for (int i = 3; i < argc; i++) request += (i > 3 ? " " : "") + string(argv[i]);
+            return runClient(param1, request);
+        }
         string param2 = argc > 3 ? argv[3] : "";
+        string kernel = argc > 4 ? argv[4] : "compressed";
+        int tileCols = argc > 5 ? stoi(argv[5]) : 0;
+        int blockRows = 256;
+        if (tileCols < 0) {
+            cerr << "tileCols must be 0 (auto) or positive!" << endl;
+            return 1;
+        }
         if (mode == "start") {
             // thread range
             minThreads = stoi(param1.substr(0, param1.find('-')));
             maxThreads = stoi(param1.substr(param1.find('-') + 1));
             // percent
             percent = stoi(param2);
+            if (!isKernel(kernel)) {
+                cerr << "Unknown kernel " << kernel << ", expected compressed | tiled | packed | esc" << endl;
+                return 1;
+            }
+        } else if (mode == "serve") {
+            // socket path in param1, matrices are loaded on request
+        } else if (mode == "pipeline") {
+            // thread budget shared by the stages
+            maxThreads = stoi(param1);
+            // percent
+            percent = stoi(param2);
+            // rows per block
+            if (argc > 4) blockRows = stoi(argv[4]);
+            if (blockRows <= 0) {
+                cerr << "blockRows must be positive!" << endl;
+                return 1;
+            }
+        } else if (mode == "bench") {
+            // thread range, the densities in param2 are loaded one after another
+            minThreads = stoi(param1.substr(0, param1.find('-')));
+            maxThreads = stoi(param1.substr(param1.find('-') + 1));
         } else {
             // percent
             percent = stoi(param1);
@@ -248,20 +1586,91 @@
         cout << "mode: " << mode << endl;
         if (mode == "init") {
             cout << "percent: " << percent << endl;
+        } else if (mode == "serve") {
+            cout << "socket: " << param1 << endl;
+        } else if (mode == "pipeline") {
+            cout << "percent: " << percent << endl;
+            cout << "num_of_threads: " << maxThreads << endl;
+            cout << "blockRows: " << blockRows << endl;
+        } else if (mode == "bench") {
+            cout << "percents: " << param2 << endl;
+            cout << "minThreads: " << minThreads << endl;
+            cout << "maxThreads: " << maxThreads << endl;
         } else {
             cout << "percent: " << percent << endl;
             cout << "minThreads: " << minThreads << endl;
             cout << "maxThreads: " << maxThreads << endl;
+            cout << "kernel: " << kernel << endl;
+            if (kernel == "tiled") cout << "tileCols: " << clampTileCols(tileCols) << (tileCols > 0 ? "" : " (auto)") << endl;
         }
         cout << "NROWS: " << NROWS << endl;
         cout << "NCOLS: " << NCOLS << endl;
 
+        // Back all matrix and result rows with one hugepage arena, sized for the dense matrices alive at once
+        if (mode == "init") reserveMatrixArena(percent, DEBUG ? 6 : 2);
+        if (mode == "start") reserveMatrixArena(percent, 1);
+        if (mode == "pack") reserveMatrixArena(percent, 0);
+
         // Matrix X = Xindices * Xvalues
         // Matrix Y = Yindices * Yvalues
-        vector<vector<int>> X, Y;
-        vector<vector<int>> Xindices, Xvalues;
-        vector<vector<int>> Yindices, Yvalues;
-        vector<vector<int>> outputOriginal, outputCompressed;
+        Matrix X, Y;
+        Matrix Xindices, Xvalues;
+        Matrix Yindices, Yvalues;
+        Matrix outputOriginal, outputCompressed, outputTiled, outputPacked;
+        Matrix outputEscValues, outputEscIndices;
+
+        if (mode == "serve") {
+            cout << "==================Starting Service====================" << endl;
+            runService(param1);
+            return 0;
+        }
+
+        if (mode == "bench") {
+            // Compare the dense-row kernel with the ESC kernel on the matrices of each density
+            cout << "==================Comparing Kernels====================" << endl;
+            stringstream percents(param2);
+            string item;
+            while (getline(percents, item, ',')) {
+                percent = stoi(item);
+                reserveMatrixArena(percent, 1);
+                {
+                    Matrix Xv, Xi, Yv, Yi;
+                    loadMatrices(Xv, Xi, percent, "X");
+                    loadMatrices(Yv, Yi, percent, "Y");
+                    matrixArena.prefault();
+                    for (int num_threads = minThreads; num_threads <= maxThreads; num_threads++) {
+                        omp_set_num_threads(num_threads);
+                        size_t arenaMark = matrixArena.mark();
+                        double start = omp_get_wtime();
+                        Matrix dense = compressedMatrixMultiply(Xv, Xi, Yv, Yi);
+                        double compressedElapsed = omp_get_wtime() - start;
+
+                        Matrix escValues, escIndices;
+                        start = omp_get_wtime();
+                        escMatrixMultiply(Xv, Xi, Yv, Yi, escValues, escIndices);
+                        double escElapsed = omp_get_wtime() - start;
+
+                        // Checked on the last run only, it takes longer than the multiplies
+                        bool identical = num_threads < maxThreads || checkCompressedIntegrity(dense, escValues, escIndices);
+                        cout << "percent: " << percent << " threads: " << num_threads << " compressed: " << compressedElapsed << "s esc: " << escElapsed
+                             << "s speedup: " << compressedElapsed / escElapsed << (identical ? "" : " RESULTS DIFFER") << endl;
+
+                        dense = Matrix();
+                        escValues = Matrix();
+                        escIndices = Matrix();
+                        matrixArena.rewind(arenaMark);
+                    }
+                }
+                matrixArena.release();
+            }
+            return 0;
+        }
+
+        if (mode == "pipeline") {
+            cout << "==================Starting Pipeline====================" << endl;
+            runPipeline(percent, maxThreads, blockRows);
+            return 0;
+        }
 
         if (mode == "init") {
             // Generate three pairs of matrices with different probability
@@ -274,6 +1683,19 @@
             if (DEBUG) outputOriginal = matrixMultiply(X, Y);
             if (DEBUG) outputCompressed = compressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices);
             if (DEBUG) cout << "Are these two matrix identical?: " << boolalpha << checkIntegrity(outputOriginal, outputCompressed) << endl;
+            if (DEBUG) outputTiled = tiledCompressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices, tileCols);
+            if (DEBUG) cout << "Is the tiled result identical?: " << boolalpha << checkIntegrity(outputCompressed, outputTiled) << endl;
+            if (DEBUG) escMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices, outputEscValues, outputEscIndices);
+            if (DEBUG) cout << "Is the ESC result identical?: " << boolalpha << checkCompressedIntegrity(outputCompressed, outputEscValues, outputEscIndices) << endl;
+
+            // Binary copies with packed indices, preferred by loadMatrices
+            PackedIndices packedX, packedY;
+            packIndices(Xindices, packedX);
+            packIndices(Yindices, packedY);
+            writePackedMatrix(Xvalues, packedX, percent, "X");
+            writePackedMatrix(Yvalues, packedY, percent, "Y");
+            if (DEBUG) outputPacked = packedCompressedMatrixMultiply(Xvalues, Xindices, Yvalues, packedY);
+            if (DEBUG) cout << "Is the packed result identical?: " << boolalpha << checkIntegrity(outputCompressed, outputPacked) << endl;
 
             cout << "Matrices generated!" << endl;
         } else {
@@ -284,18 +1706,44 @@
             cout << "Matrices loaded!" << endl;
         }
 
+        if (mode == "pack") {
+            // Convert existing text files into the binary packed format
+            PackedIndices packedX, packedY;
+            packIndices(Xindices, packedX);
+            packIndices(Yindices, packedY);
+            writePackedMatrix(Xvalues, packedX, percent, "X");
+            writePackedMatrix(Yvalues, packedY, percent, "Y");
+            cout << "Packed index bytes: " << packedX.bytes.size() + packedY.bytes.size() << " (" << 4 * (countNonZeros(Xvalues) + countNonZeros(Yvalues)) << " as plain ints)" << endl;
+        }
+
         // Experiement with different threads
         if (mode == "start") {
             cout << "==================Starting Experiments====================" << endl;
+            PackedIndices packedY;
+            if (kernel == "packed") packIndices(Yindices, packedY);
+            // Commit the result's pages up front, otherwise only the first thread count pays for the page faults
+            matrixArena.prefault();
             for (int num_threads = minThreads; num_threads <= maxThreads; num_threads++) {
                 omp_set_num_threads(num_threads);
                 cout << "<<<<<<<<<< Evaluating timelapse with probability: " << percent << " and " << num_threads << " threads >>>>>>>>>>" << endl;
 
+                // Every run drops its result right away, so the next run reuses the same arena space
+                size_t arenaMark = matrixArena.mark();
+
                 // Time counter + compressed matrix multiplication
                 double start = omp_get_wtime();
-                compressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices);
+                if (kernel == "tiled") {
+                    tiledCompressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices, tileCols);
+                } else if (kernel == "packed") {
+                    packedCompressedMatrixMultiply(Xvalues, Xindices, Yvalues, packedY);
+                } else if (kernel == "esc") {
+                    Matrix resultValues, resultIndices;
+                    escMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices, resultValues, resultIndices);
+                } else {
+                    compressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices);
+                }
                 double end = omp_get_wtime();
-
+                matrixArena.rewind(arenaMark);
 
                 // Get the current system time for the "Finished at" timestamp
                 auto now = std::chrono::system_clock::now();
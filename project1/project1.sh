@@ -6,16 +6,26 @@
 #SBATCH --mem=220G
 #SBATCH --time=23:59:59
 
-# [init | start]
+# [init | start | pack | pipeline | serve | bench]
 ARG1=$1
-# [percent | thread_range]
+# [percent | thread_range | num_of_threads | socket]
 ARG2=$2
-# [percent (if mode set to start)
+# [percent (if mode set to start or pipeline) | percents, e.g. 1,2,5 (if mode set to bench)]
 ARG3=$3
+# [kernel: compressed | tiled | packed | esc | blockRows (if mode set to pipeline)] (optional)
+ARG4=$4
+# [tileCols, 0 = auto] (optional, for the tiled kernel)
+ARG5=$5
 
 # extract the upper limit of the thread range for cpus-per-task
 MAXTHREADS=$(echo $ARG2 | cut -d'-' -f2)
 
+# service mode takes [socket] [num_of_threads to reserve] instead
+if [ "$ARG1" == "serve" ]; then
+    MAXTHREADS=${ARG3:-1}
+    ARG3=""
+fi
+
 echo "srun ./project1 $ARG1 $ARG2 ${ARG3:-"No ARG3"}"
 echo "Running with --cpus-per-task=$MAXTHREADS"
 
@@ -27,4 +37,4 @@ export OMP_PLACES=cores      # Bind each thread to a specific core
 g++ -o project1 -fopenmp ./project1.c
 
 # pass the probability for matrix generation
-srun --cpus-per-task=$MAXTHREADS ./project1 $ARG1 $ARG2 $ARG3
\ No newline at end of file
+srun --cpus-per-task=$MAXTHREADS ./project1 $ARG1 $ARG2 $ARG3 $ARG4 $ARG5
\ No newline at end of file
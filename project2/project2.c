@@ -1,9 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <chrono>
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <immintrin.h>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -13,11 +27,136 @@
 using namespace std;
 
 #define DEBUG false // Enable to output matrix generation and matrix multiplication
+#define WRITE_RESULT DEBUG // Write the result of every experiment as a binary CSR file
+#define RESULT_ON_ROOT false // Gather the whole dense result on rank 0, otherwise every rank keeps the rows it computed
 int NROWS = 10000; // Number of rows of the matrix
 int NCOLS = 10000; // Number of columns of the matrix
+#define ARENA_HUGEPAGES 1 // Backing of the matrix arena: 0 = regular pages, 1 = transparent hugepages, 2 = explicit hugepages
+
+#define HUGEPAGE_SIZE (2UL << 20)
+
+/**
+ * Arena
+ * @description bump allocator over one large anonymous mapping backed by hugepages, used for all matrix and result rows.
+ * @description Blocks are never freed one by one, the arena is rewound to a mark or unmapped as a whole
+ */
+struct Arena {
+    char *base = nullptr;
+    size_t capacity = 0;
+    atomic<size_t> used{0};
+
+    /**
+     * reserve
+     * @description map the arena, pages are only committed when first touched so overestimating is cheap
+     * @param bytes {size_t} capacity of the arena
+     */
+    void reserve(size_t bytes) {
+        release();
+        capacity = (bytes + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+        void *mapping = MAP_FAILED;
+        if (ARENA_HUGEPAGES == 2) {
+            // Without MAP_NORESERVE the hugepages are reserved here, so a short pool fails this call instead of a later page fault (SIGBUS)
+            mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mapping == MAP_FAILED) cerr << "Explicit hugepages unavailable, falling back to transparent hugepages" << endl;
+        }
+        if (mapping == MAP_FAILED) {
+            mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mapping != MAP_FAILED && ARENA_HUGEPAGES >= 1) madvise(mapping, capacity, MADV_HUGEPAGE);
+        }
+        if (mapping == MAP_FAILED) {
+            cerr << "Error mapping matrix arena, using the default allocator!" << endl;
+            capacity = 0;
+            return;
+        }
+        base = (char*)mapping;
+        used = 0;
+    }
+
+    // returns nullptr when the block does not fit so the caller can fall back to the heap, smaller blocks may still fit later
+    void *allocate(size_t bytes) {
+        if (base == nullptr) return nullptr;
+        bytes = (bytes + 63) & ~(size_t)63; // keep every block cache line aligned
+        size_t offset = used.load();
+        do {
+            if (bytes > capacity - offset) return nullptr;
+        } while (!used.compare_exchange_weak(offset, offset + bytes));
+        return base + offset;
+    }
+
+    bool owns(const void *p) const {
+        return base != nullptr && (const char*)p >= base && (const char*)p < base + capacity;
+    }
+
+    size_t mark() const { return used.load(); }
+
+    // drop every block allocated after the mark, they must no longer be in use
+    void rewind(size_t mark) { used = min(mark, capacity); }
+
+    void release() {
+        if (base != nullptr) munmap(base, capacity);
+        base = nullptr;
+        capacity = 0;
+        used = 0;
+    }
+
+    ~Arena() { release(); }
+};
+
+Arena matrixArena;
+
+/**
+ * ArenaAllocator
+ * @description STL allocator drawing from matrixArena, falls back to the heap when the arena is not reserved or full
+ */
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+    ArenaAllocator() {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        void *p = matrixArena.allocate(n * sizeof(T));
+        return (T*)(p != nullptr ? p : ::operator new(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t) {
+        if (!matrixArena.owns(p)) ::operator delete(p);
+    }
+};
+template <typename T, typename U> bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+template <typename T, typename U> bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+
+typedef vector<int, ArenaAllocator<int>> Row;
+typedef vector<Row> Matrix;
+
+/**
+ * expectedRowNonZeros
+ * @description capacity to reserve for a compressed row, the mean plus a few standard deviations of the binomial count
+ */
+int expectedRowNonZeros(int percent) {
+    double mean = (double)NCOLS * percent / 100;
+    return (int)(mean + 4 * sqrt(mean)) + 2;
+}
+
+/**
+ * reserveMatrixArena
+ * @description size the arena from the estimated nnz: compressed rows of X and Y, the dense result and,
+ * @description without MPI, the flat CSR block of X and Y (under MPI that block is a shared window)
+ * @param percent {int} probability of non-zeros
+ */
+void reserveMatrixArena(int percent) {
+    size_t rowBytes = ((size_t)expectedRowNonZeros(percent) * sizeof(int) + 63) & ~(size_t)63;
+    size_t compressedBytes = 4 * (size_t)NROWS * rowBytes; // values and indices rows of X and Y as generated on rank 0
+    size_t denseBytes = (size_t)NROWS * (((size_t)NCOLS * sizeof(int) + 63) & ~(size_t)63);
+    size_t blockBytes = 0;
+#ifndef _MPI
+    blockBytes = 2 * ((size_t)NROWS + 1) * sizeof(long) + 4 * (size_t)NROWS * expectedRowNonZeros(percent) * sizeof(int);
+#endif
+    matrixArena.reserve(compressedBytes + denseBytes + blockBytes);
+}
+
 
 // Function to write matrices to files in rank 0 (for debug mode)
-void writeMatrixToFile(const vector<vector<int>> &values, const vector<vector<int>> &indices, string suffix) {
+void writeMatrixToFile(const Matrix &values, const Matrix &indices, string suffix) {
 
     // open two files for writing
     FILE *fpb, *fpc;
@@ -32,8 +171,8 @@ void writeMatrixToFile(const vector<vector<int>> &values, const vector<vector<in
         return;
     }
 
-    for (int i = 0; i < values.size(); i++) {
-        for (int j = 0; j < values[i].size(); j++) {
+    for (int i = 0; i < (int)values.size(); i++) {
+        for (int j = 0; j < (int)values[i].size(); j++) {
             // write value and index into file
             fprintf(fpb, "%d ", values[i][j]);
             fprintf(fpc, "%d ", indices[i][j]);
@@ -49,6 +188,140 @@ void writeMatrixToFile(const vector<vector<int>> &values, const vector<vector<in
     fclose(fpc);
 }
 
+/**
+ * PackedIndices
+ * @description delta-encoded column indices of a compressed matrix (indices are strictly increasing within a row).
+ * @description Row r starts at bytes[offsets[r]] with a header (delta width in bytes, count, first index)
+ * @description followed by count - 1 deltas of 1, 2 or 4 bytes, the narrowest width that fits the row's largest gap
+ */
+struct PackedIndices {
+    vector<uint8_t> bytes;
+    vector<long> offsets;
+};
+
+#define PACKED_ROW_HEADER 9 // 1 byte width + 4 bytes count + 4 bytes first index
+
+int packedDeltaWidth(const Row &rowIndices) {
+    int maxDelta = 0;
+    for (int k = 1; k < (int)rowIndices.size(); k++) maxDelta = max(maxDelta, rowIndices[k] - rowIndices[k - 1]);
+    return maxDelta < (1 << 8) ? 1 : (maxDelta < (1 << 16) ? 2 : 4);
+}
+
+/**
+ * packIndices
+ * @description encode every row of an index matrix, row sizes are computed first so rows are encoded in parallel
+ * @param indices {vector<vector<>>} the compressed index matrix
+ * @param packed {PackedIndices} the encoded matrix
+ */
+void packIndices(const Matrix &indices, PackedIndices &packed) {
+    int nRows = indices.size();
+    vector<int> widths(nRows);
+    packed.offsets.assign(nRows + 1, 0);
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int row = 0; row < nRows; row++) {
+        widths[row] = packedDeltaWidth(indices[row]);
+        packed.offsets[row + 1] = PACKED_ROW_HEADER + (long)max((int)indices[row].size() - 1, 0) * widths[row];
+    }
+    for (int row = 0; row < nRows; row++) packed.offsets[row + 1] += packed.offsets[row];
+    packed.bytes.resize(packed.offsets[nRows]);
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int row = 0; row < nRows; row++) {
+        const Row &rowIndices = indices[row];
+        uint8_t *p = &packed.bytes[packed.offsets[row]];
+        int count = rowIndices.size();
+        int first = count > 0 ? rowIndices[0] : 0;
+        p[0] = widths[row];
+        memcpy(p + 1, &count, 4);
+        memcpy(p + 5, &first, 4);
+        p += PACKED_ROW_HEADER;
+        for (int k = 1; k < count; k++) {
+            // little-endian, so the low bytes of the delta are its narrow encoding
+            uint32_t delta = rowIndices[k] - rowIndices[k - 1];
+            memcpy(p, &delta, widths[row]);
+            p += widths[row];
+        }
+    }
+}
+
+void decodeDeltasScalar(const uint8_t *deltas, int width, int count, int running, int *out) {
+    for (int k = 0; k < count; k++) {
+        uint32_t delta = 0;
+        memcpy(&delta, deltas + (size_t)k * width, width);
+        running += delta;
+        out[k] = running;
+    }
+}
+
+/**
+ * decodeDeltasAVX2
+ * @description widen 8 deltas to 32 bits, prefix-sum them in-register and add the running index
+ */
+__attribute__((target("avx2")))
+void decodeDeltasAVX2(const uint8_t *deltas, int width, int count, int running, int *out) {
+    __m256i base = _mm256_set1_epi32(running);
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i x;
+        if (width == 1) {
+            x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(deltas + k)));
+        } else if (width == 2) {
+            x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(deltas + 2 * k)));
+        } else {
+            x = _mm256_loadu_si256((const __m256i*)(deltas + 4 * k));
+        }
+        // inclusive prefix sum within each 128-bit lane, then carry the low lane's total into the high lane
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        __m256i carry = _mm256_shuffle_epi32(x, 0xFF);
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(carry, carry, 0x08));
+        x = _mm256_add_epi32(x, base);
+        _mm256_storeu_si256((__m256i*)(out + k), x);
+        base = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7));
+    }
+    if (k < count) decodeDeltasScalar(deltas + (size_t)k * width, width, count - k, k > 0 ? out[k - 1] : running, out + k);
+}
+
+/**
+ * decodeDeltas
+ * @description decode count deltas into absolute indices starting from running, using AVX2 when the CPU has it
+ */
+void decodeDeltas(const uint8_t *deltas, int width, int count, int running, int *out) {
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    if (hasAVX2) {
+        decodeDeltasAVX2(deltas, width, count, running, out);
+    } else {
+        decodeDeltasScalar(deltas, width, count, running, out);
+    }
+}
+
+/**
+ * unpackIndices
+ * @description decode every row of a packed index matrix into flat indices, row r starting at indices[rowStart[r]]
+ */
+void unpackIndices(const PackedIndices &packed, const long *rowStart, int *indices) {
+    int nRows = packed.offsets.size() - 1;
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int row = 0; row < nRows; row++) {
+        const uint8_t *p = &packed.bytes[packed.offsets[row]];
+        int width = p[0], count, first;
+        memcpy(&count, p + 1, 4);
+        memcpy(&first, p + 5, 4);
+        if (count == 0) continue;
+        int *rowIndices = indices + rowStart[row];
+        rowIndices[0] = first;
+        decodeDeltas(p + PACKED_ROW_HEADER, width, count - 1, first, rowIndices + 1);
+    }
+}
+
 /**
  * generateMatrices
  * @description generate two baby matrices with certain probability of non-zero values
@@ -59,9 +332,17 @@ void writeMatrixToFile(const vector<vector<int>> &values, const vector<vector<in
  * @param rank {int} MPI rank for partitioning
  * @param nProcesses {int} Number of MPI processes
  */
-void generateMatrices(vector<vector<int>>& values, vector<vector<int>>& indices, int percent, int rank, int nProcesses) {
+void generateMatrices(Matrix& values, Matrix& indices, int percent, int rank, int nProcesses) {
+    // Existing rows are refilled in place so their capacity is reused between runs
+    values.resize(NROWS);
+    indices.resize(NROWS);
     for (int row = 0; row < NROWS; row++) {
-        vector<int> rowValues, rowIndices;
+        Row &rowValues = values[row], &rowIndices = indices[row];
+        rowValues.clear();
+        rowIndices.clear();
+        // reserve up front so push_back does not reallocate inside the arena
+        rowValues.reserve(expectedRowNonZeros(percent));
+        rowIndices.reserve(expectedRowNonZeros(percent));
         for (int col = 0; col < NCOLS; col++) {
             if (rand() % 100 < percent) {
                 // Random value between 1 and 10
@@ -77,179 +358,939 @@ void generateMatrices(vector<vector<int>>& values, vector<vector<int>>& indices,
             rowValues.assign(2, 0);
             rowIndices.assign(2, 0);
         }
-        values.push_back(rowValues);
-        indices.push_back(rowIndices);
     }
 }
 
+/**
+ * CsrMatrix
+ * @description a compressed matrix in flat arrays: row i holds values[offsets[i]] to values[offsets[i + 1] - 1],
+ * @description with the column indices at the same positions of indices
+ */
+struct CsrMatrix {
+    long *offsets = nullptr;
+    int *values = nullptr;
+    int *indices = nullptr;
+};
+
+/**
+ * localRowRange
+ * @description rows of X (and of the result) computed by this rank
+ */
+void localRowRange(int rank, int nProcesses, int &start_row, int &end_row) {
+    int local_rows = NROWS / nProcesses;
+    start_row = rank * local_rows;
+    end_row = (rank == nProcesses - 1) ? NROWS : start_row + local_rows;
+}
+
+/**
+ * entriesInRows
+ * @description entries first to last - 1 of row i of X whose column, the row of Y they multiply, lies in
+ * @description [yFirstRow, yLastRow). Indices are sorted within a row
+ */
+inline void entriesInRows(const CsrMatrix& X, int i, int yFirstRow, int yLastRow, long &first, long &last) {
+    first = lower_bound(X.indices + X.offsets[i], X.indices + X.offsets[i + 1], yFirstRow) - X.indices;
+    last = lower_bound(X.indices + first, X.indices + X.offsets[i + 1], yLastRow) - X.indices;
+}
+
+#ifdef _MPI
+/**
+ * gatherDenseResult
+ * @description collect the dense result rows of every rank on rank 0, whose result has a slot for every row
+ * @param resultFirstRow {int} row of the full result held by result[0] on the other ranks
+ */
+void gatherDenseResult(Matrix& result, int resultFirstRow, int rank, int nProcesses) {
+    // Rows are separate vectors, so each message covers a batch of rows through a datatype built from their
+    // addresses. Batches stay under 1 GB to keep the byte count within an int
+    int rowsPerMessage = max(1, (1 << 30) / (int)(NCOLS * sizeof(int)));
+    // Rank 0 receives from every other rank, every other rank sends its own rows
+    int firstSource = rank == 0 ? 1 : rank, lastSource = rank == 0 ? nProcesses - 1 : rank;
+    for (int source = firstSource; source <= lastSource; source++) {
+        int batch_start, batch_end;
+        localRowRange(source, nProcesses, batch_start, batch_end);
+        for (int batch = batch_start; batch < batch_end; batch += rowsPerMessage) {
+            int nRows = min(rowsPerMessage, batch_end - batch);
+            vector<MPI_Aint> addresses(nRows);
+            vector<int> lengths(nRows, NCOLS);
+            for (int row = 0; row < nRows; row++) {
+                MPI_Get_address(result[batch + row - (rank == 0 ? 0 : resultFirstRow)].data(), &addresses[row]);
+            }
+            MPI_Datatype rows;
+            MPI_Type_create_hindexed(nRows, lengths.data(), addresses.data(), MPI_INT, &rows);
+            MPI_Type_commit(&rows);
+            // One tag for every message, messages from one source arrive in the order they were sent
+            if (rank == 0) {
+                MPI_Recv(MPI_BOTTOM, 1, rows, source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            } else {
+                MPI_Send(MPI_BOTTOM, 1, rows, 0, 0, MPI_COMM_WORLD);
+            }
+            MPI_Type_free(&rows);
+        }
+    }
+}
+#endif
+
 /**
  * compressedMatrixMultiply
  * @description The matrix multiply function on compressed matrices
- * @param Xvalues {vector<vector<>>} the Xvalues matrix
- * @param Xindices {vector<vector<>>} the Xindices matrix
- * @param Yvalues {vector<vector<>>} the Yvalues matrix
- * @param Yindices {vector<vector<>>} the Yindices matrix
- * @param result {vector<vector<int>>} the resulting matrix
+ * @param X {CsrMatrix} the X matrix
+ * @param Y {CsrMatrix} the Y matrix, only rows yFirstRow to yLastRow - 1 are read
+ * @param yFirstRow {int} first row of Y to multiply with, 0 for all of Y
+ * @param yLastRow {int} one past the last row of Y to multiply with, NROWS for all of Y
+ * @param result {Matrix} the resulting matrix, added to
+ * @param resultFirstRow {int} row of the full result held by result[0], 0 if result has a slot for every row
+ * @param gather {bool} collect all rows on rank 0, whose result must then have a slot for every row
  * @param rank {int} MPI rank for partitioning
  * @param nProcesses {int} Number of MPI processes
  */
-void compressedMatrixMultiply(const vector<vector<int>>& Xvalues, const vector<vector<int>>& Xindices, 
-                              const vector<vector<int>>& Yvalues, const vector<vector<int>>& Yindices,
-                              vector<vector<int>>& result, int rank, int nProcesses) {
+void compressedMatrixMultiply(const CsrMatrix& X, const CsrMatrix& Y, int yFirstRow, int yLastRow,
+                              Matrix& result, int resultFirstRow, bool gather, int rank, int nProcesses) {
 
-    int local_rows = NROWS / nProcesses;
-    int start_row = rank * local_rows;
-    int end_row = (rank == nProcesses - 1) ? NROWS : start_row + local_rows;
+    int start_row, end_row;
+    localRowRange(rank, nProcesses, start_row, end_row);
     
 #ifdef _OPENMP
     #pragma omp parallel for
 #endif
     for (int i = start_row; i < end_row; i++) {
-        for (int j = 0; j < Xvalues[i].size(); j++) {
-            int X_value = Xvalues[i][j];
-            int X_indice = Xindices[i][j];
-            for (int k = 0; k < Yvalues[X_indice].size(); ++k) {
-                int Y_value = Yvalues[X_indice][k];
-                int Y_indice = Yindices[X_indice][k];
+        Row &resultRow = result[i - resultFirstRow];
+        long first, last;
+        entriesInRows(X, i, yFirstRow, yLastRow, first, last);
+        for (long j = first; j < last; j++) {
+            int X_value = X.values[j];
+            int X_indice = X.indices[j];
+            for (long k = Y.offsets[X_indice]; k < Y.offsets[X_indice + 1]; ++k) {
+                int Y_value = Y.values[k];
+                int Y_indice = Y.indices[k];
 #ifdef _OPENMP
                 //! this operation creates lots of overhead, but creating local copies of huge matrix is impractical....
                 #pragma omp atomic
 #endif
-                result[i][Y_indice] += X_value * Y_value;
+                resultRow[Y_indice] += X_value * Y_value;
             }
         }
     }
 #ifdef _MPI
     // Synchronize processes after computation
     MPI_Barrier(MPI_COMM_WORLD);
+    if (gather) gatherDenseResult(result, resultFirstRow, rank, nProcesses);
+#endif
+}
+
+/**
+ * sparseMatrixMultiply
+ * @description The matrix multiply producing compressed result rows for this rank's rows, with one dense
+ * @description accumulator per thread, so the result takes memory in proportion to its nnz
+ * @param yFirstRow {int} first row of Y to multiply with, 0 for all of Y
+ * @param yLastRow {int} one past the last row of Y to multiply with, NROWS for all of Y
+ * @param resultValues {Matrix} values of the result rows start_row to end_row of this rank
+ * @param resultIndices {Matrix} sorted column indices of the same rows
+ * @param accumulate {bool} add the products to the rows already in the result instead of replacing them
+ */
+void sparseMatrixMultiply(const CsrMatrix& X, const CsrMatrix& Y, int yFirstRow, int yLastRow,
+                          Matrix& resultValues, Matrix& resultIndices, bool accumulate, int rank, int nProcesses) {
+    int start_row, end_row;
+    localRowRange(rank, nProcesses, start_row, end_row);
+    if (!accumulate) {
+        resultValues.resize(end_row - start_row);
+        resultIndices.resize(end_row - start_row);
+        for (Row &row : resultValues) row.clear();
+        for (Row &row : resultIndices) row.clear();
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        // marker[col] is the last row that touched col, touched lists the columns of the current row
+        vector<int> accumulator(NCOLS, 0), marker(NCOLS, -1), touched;
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 64)
+#endif
+        for (int i = start_row; i < end_row; i++) {
+            Row &rowValues = resultValues[i - start_row], &rowIndices = resultIndices[i - start_row];
+            long first, last;
+            entriesInRows(X, i, yFirstRow, yLastRow, first, last);
+            if (first == last) continue;
+            touched.assign(rowIndices.begin(), rowIndices.end());
+            for (size_t e = 0; e < rowIndices.size(); e++) {
+                marker[rowIndices[e]] = i;
+                accumulator[rowIndices[e]] = rowValues[e];
+            }
+            for (long j = first; j < last; j++) {
+                int X_value = X.values[j];
+                int X_indice = X.indices[j];
+                for (long k = Y.offsets[X_indice]; k < Y.offsets[X_indice + 1]; ++k) {
+                    int Y_indice = Y.indices[k];
+                    if (marker[Y_indice] != i) {
+                        marker[Y_indice] = i;
+                        touched.push_back(Y_indice);
+                    }
+                    accumulator[Y_indice] += X_value * Y.values[k];
+                }
+            }
+
+            sort(touched.begin(), touched.end());
+            rowValues.clear();
+            rowIndices.clear();
+            for (int col : touched) {
+                if (accumulator[col] != 0) {
+                    rowValues.push_back(accumulator[col]);
+                    rowIndices.push_back(col);
+                }
+                accumulator[col] = 0;
+            }
+        }
+    }
+#ifdef _MPI
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
 
-    // Gather the results from all processes to rank 0
-    if (rank == 0) {
-        for (int i = 1; i < nProcesses; ++i) {
-            MPI_Recv(&result[0][0], NROWS * NCOLS, MPI_INT, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/**
+ * Strategy
+ * @description how the result is stored: dense rows gathered on rank 0 (the original), dense rows kept by
+ * @description the rank that computed them, or compressed rows kept by the rank that computed them.
+ * @description X is replicated on every node in all of them, Y is replicated or distributed (see Plan)
+ */
+enum Strategy { NO_STRATEGY = -1, DENSE_GATHER = 0, DENSE_DISTRIBUTED = 1, SPARSE_DISTRIBUTED = 2 };
+const int N_STRATEGIES = 3;
+const char *strategyNames[N_STRATEGIES] = {"dense-gather", "dense-distributed", "sparse-distributed"};
+
+/**
+ * Plan
+ * @description the strategy and where Y lives: one copy per node like X, or a slice of its rows per rank that
+ * @description travels around a ring of the ranks, so each rank multiplies its rows of X by one slice at a time
+ */
+struct Plan {
+    Strategy strategy = NO_STRATEGY;
+    bool distributedY = false;
+};
+
+/**
+ * WorkEstimate
+ * @description predicted size of one multiplication, analytic from the density or sampled from rows of X
+ */
+struct WorkEstimate {
+    double inputNonZeros; // per input matrix
+    double flops; // multiply-adds
+    double outputNonZeros;
+    string source;
+};
+
+/**
+ * MemoryBudget
+ * @description memory available to each rank and where the limit came from
+ */
+struct MemoryBudget {
+    double bytesPerRank;
+    int ranksPerNode;
+    string source;
+};
+
+WorkEstimate analyticEstimate(int percent) {
+    double d = percent / 100.0, n = NROWS;
+    WorkEstimate work;
+    work.inputNonZeros = n * n * d;
+    work.flops = n * (n * d) * (n * d);
+    // each of the n terms of an output entry is non-zero with probability d^2
+    work.outputNonZeros = n * n * (1 - pow(1 - d * d, n));
+    work.source = "analytic";
+    return work;
+}
+
+/**
+ * sampledEstimate
+ * @description exact flops and output nnz of evenly spaced rows of X, extrapolated to all rows
+ * @param nSamples {int} number of rows to sample
+ */
+WorkEstimate sampledEstimate(const Matrix& Xindices, const Matrix& Yindices, int nSamples) {
+    WorkEstimate work;
+    work.inputNonZeros = 0;
+    for (const Row &row : Xindices) work.inputNonZeros += row.size();
+
+    vector<int> marker(NCOLS, -1);
+    double flops = 0, outputNonZeros = 0;
+    int step = max(1, NROWS / nSamples), taken = 0;
+    for (int i = 0; i < NROWS; i += step, taken++) {
+        for (int X_indice : Xindices[i]) {
+            flops += Yindices[X_indice].size();
+            for (int Y_indice : Yindices[X_indice]) {
+                if (marker[Y_indice] != i) {
+                    marker[Y_indice] = i;
+                    outputNonZeros++;
+                }
+            }
         }
+    }
+    work.flops = flops / taken * NROWS;
+    work.outputNonZeros = outputNonZeros / taken * NROWS;
+    work.source = "sampled from " + to_string(taken) + " rows of X";
+    return work;
+}
+
+// One copy of X and Y per node shared by its ranks, plus the rows generated on rank 0 and their packed indices.
+// The ranks of a node share its memory, so the node's input memory is spread over them. A distributed Y leaves
+// only its offsets in the node's copy, and each rank holds two slices of it (the one in use and the next one)
+double inputBytes(const WorkEstimate &work, int ranksPerNode, int nProcesses, bool distributedY) {
+    double sharedBytes = (distributedY ? 1 : 2) * work.inputNonZeros * 2 * sizeof(int) + 2 * (NROWS + 1.0) * sizeof(long);
+    double generatedBytes = 2 * work.inputNonZeros * 3 * sizeof(int);
+    double sliceBytes = distributedY ? 2 * (work.inputNonZeros / nProcesses) * 2 * sizeof(int) + (NROWS + 1.0) * sizeof(long) : 0;
+    return (sharedBytes + generatedBytes) / ranksPerNode + sliceBytes;
+}
+
+/**
+ * estimateStrategy
+ * @description peak memory of the busiest rank and predicted time of one plan. The per-operation
+ * @description costs are rough single-core figures, good enough to rank the plans against each other
+ */
+void estimateStrategy(const Plan &plan, const WorkEstimate &work, int nProcesses, int nThreads, int ranksPerNode, double &peakBytes, double &seconds) {
+    const double scatterCost = 2e-9; // per multiply-add into a dense row
+    const double sparseCost = 4e-9; // per multiply-add through the marker and accumulator
+    const double emitCost = 10e-9; // per output non-zero, sorting and copying the touched columns
+    const double zeroCost = 0.1e-9; // per byte of dense result zeroed
+    const double gatherCost = 0.2e-9; // per byte sent to rank 0
+    const double transferCost = 0.5e-9; // per byte of Y received by a rank, broadcast or ring
+
+    double n = NROWS;
+    double localRows = ceil(n / nProcesses);
+    double denseBytes = n * n * sizeof(int);
+    double parallelFlops = work.flops / nProcesses / nThreads;
+    double localOutput = work.outputNonZeros / nProcesses;
+    double Ybytes = work.inputNonZeros * 2 * sizeof(int);
+    double nNodes = ceil((double)nProcesses / ranksPerNode);
+
+    peakBytes = inputBytes(work, ranksPerNode, nProcesses, plan.distributedY);
+    if (plan.distributedY) {
+        // every rank receives the p - 1 slices it does not own
+        seconds = Ybytes * (nProcesses - 1) / nProcesses * transferCost;
     } else {
-        // Send local results to rank 0
-        MPI_Send(&result[start_row][0], local_rows * NCOLS, MPI_INT, 0, 0, MPI_COMM_WORLD);
+        // the leaders' broadcast tree is log2(nodes) deep
+        seconds = Ybytes * ceil(log2(nNodes)) * transferCost;
     }
+
+    if (plan.strategy == DENSE_GATHER) {
+        peakBytes += denseBytes; // rank 0 holds every row
+        seconds += parallelFlops * scatterCost + denseBytes * zeroCost + denseBytes * (nProcesses - 1) / nProcesses * gatherCost;
+    } else if (plan.strategy == DENSE_DISTRIBUTED) {
+        peakBytes += localRows * n * sizeof(int);
+        seconds += parallelFlops * scatterCost + localRows * n * sizeof(int) * zeroCost;
+    } else {
+        peakBytes += localOutput * 2 * sizeof(int) + (double)nThreads * n * 2 * sizeof(int);
+        seconds += parallelFlops * sparseCost + localOutput / nThreads * emitCost;
+        // each slice after the first merges into the rows built so far, on average half the final rows
+        if (plan.distributedY) seconds += localOutput / nThreads * emitCost * (nProcesses - 1) / 2;
+    }
+}
+
+/**
+ * detectMemoryBudget
+ * @description memory per rank from the command line, else the slurm allocation, else the node's physical memory
+ * @param memGB {double} limit per node in GB given on the command line, 0 to detect it
+ * @param ranksPerNode {int} ranks sharing a node's memory
+ */
+MemoryBudget detectMemoryBudget(double memGB, int ranksPerNode) {
+    MemoryBudget budget;
+    double nodeBytes;
+    if (memGB > 0) {
+        nodeBytes = memGB * (1UL << 30);
+        budget.source = "command line";
+    } else if (getenv("SLURM_MEM_PER_NODE") != nullptr) {
+        nodeBytes = atof(getenv("SLURM_MEM_PER_NODE")) * (1UL << 20);
+        budget.source = "SLURM_MEM_PER_NODE";
+    } else {
+        nodeBytes = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+        budget.source = "physical memory";
+    }
+    budget.ranksPerNode = max(1, ranksPerNode);
+    budget.bytesPerRank = nodeBytes / budget.ranksPerNode;
+    return budget;
+}
+
+/**
+ * choosePlan
+ * @description estimate every plan that leaves the result where it is needed, print them and pick the fastest
+ * @description one whose peak fits in 90% of the memory per rank (the rest is left for the runtime and page tables)
+ * @param resultOnRoot {bool} the whole result must end up on rank 0, which only dense-gather does
+ * @return {Plan} the chosen plan, strategy NO_STRATEGY if none fits
+ */
+Plan choosePlan(const WorkEstimate &work, int nProcesses, int nThreads, const MemoryBudget &budget, bool resultOnRoot) {
+    const double GB = 1UL << 30;
+    cout << "==================Execution Plan====================" << endl;
+    cout << "Estimates (" << work.source << "): input nnz " << (long)work.inputNonZeros << " per matrix, "
+         << (long)work.flops << " multiply-adds, output nnz " << (long)work.outputNonZeros << endl;
+    cout << "Memory per rank: " << budget.bytesPerRank / GB << " GB (" << budget.source << ", " << budget.ranksPerNode << " ranks per node)" << endl;
+    cout << "Result: " << (resultOnRoot ? "whole on rank 0" : "rows kept by the rank that computed them") << endl;
+
+    Plan chosen;
+    double chosenSeconds = 0, chosenPeak = 0, smallestPeak = -1;
+    for (int i = 0; i < N_STRATEGIES; i++) {
+        // Only dense-gather leaves the result on rank 0, and it is dominated by dense-distributed otherwise
+        if (((Strategy)i == DENSE_GATHER) != resultOnRoot) continue;
+        // Y can only be split over several ranks
+        for (int distributedY = 0; distributedY <= (nProcesses > 1 ? 1 : 0); distributedY++) {
+            Plan plan;
+            plan.strategy = (Strategy)i;
+            plan.distributedY = distributedY;
+            double peakBytes, seconds;
+            estimateStrategy(plan, work, nProcesses, nThreads, budget.ranksPerNode, peakBytes, seconds);
+            bool fits = peakBytes <= 0.9 * budget.bytesPerRank;
+            cout << "  " << strategyNames[i] << ", Y " << (plan.distributedY ? "distributed" : "replicated") << ": peak " << peakBytes / GB
+                 << " GB per rank, predicted " << seconds << "s" << (fits ? "" : " (does not fit)") << endl;
+            if (fits && (chosen.strategy == NO_STRATEGY || seconds < chosenSeconds)) {
+                chosen = plan;
+                chosenSeconds = seconds;
+                chosenPeak = peakBytes;
+            }
+            if (smallestPeak < 0 || peakBytes < smallestPeak) smallestPeak = peakBytes;
+        }
+    }
+
+    if (chosen.strategy == NO_STRATEGY) {
+        cout << "No strategy fits, the smallest needs --mem=" << (long)ceil(smallestPeak * budget.ranksPerNode / 0.9 / (1UL << 20)) << "M per node" << endl;
+    } else {
+        cout << "Chosen: " << strategyNames[chosen.strategy] << ", Y " << (chosen.distributedY ? "distributed" : "replicated")
+             << ", size the job with --mem=" << (long)ceil(chosenPeak * budget.ranksPerNode / 0.9 / (1UL << 20)) << "M per node" << endl;
+    }
+    return chosen;
+}
+
+/**
+ * SharedInputs
+ * @description X and Y as flat CSR arrays in one block: offsets of X and Y, then values and indices of X and Y.
+ * @description Under MPI the block is a window allocated by one leader rank per node and mapped by the other
+ * @description ranks of the node, so each node holds a single copy. Only the leaders take part in the broadcast.
+ * @description A distributed Y keeps only its offsets here, its values and indices are then null
+ */
+struct SharedInputs {
+    char *base = nullptr;
+    CsrMatrix X, Y;
+    vector<char, ArenaAllocator<char>> local; // backing of the block without MPI, from the hugepage arena
+#ifdef _MPI
+    MPI_Win window = MPI_WIN_NULL;
+    MPI_Comm nodeComm = MPI_COMM_NULL; // ranks of this node
+    MPI_Comm leaderComm = MPI_COMM_NULL; // rank 0 of every node, MPI_COMM_NULL on the other ranks
 #endif
+};
+
+/**
+ * allocateSharedInputs
+ * @description allocate the block for X and Y with the given nnz and point the CSR arrays into it, collective under MPI
+ */
+void allocateSharedInputs(SharedInputs &inputs, long nnzX, long nnzY, int rank) {
+    size_t bytes = 2 * (NROWS + 1) * sizeof(long) + 2 * (nnzX + nnzY) * sizeof(int);
+#ifdef _MPI
+    // key = rank keeps world rank 0 the leader of its node and rank 0 among the leaders
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &inputs.nodeComm);
+    int nodeRank;
+    MPI_Comm_rank(inputs.nodeComm, &nodeRank);
+    MPI_Comm_split(MPI_COMM_WORLD, nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &inputs.leaderComm);
+
+    MPI_Win_allocate_shared(nodeRank == 0 ? bytes : 0, 1, MPI_INFO_NULL, inputs.nodeComm, &inputs.base, &inputs.window);
+    MPI_Aint size;
+    int dispUnit;
+    MPI_Win_shared_query(inputs.window, 0, &size, &dispUnit, &inputs.base);
+    // The window does not come from the arena, so every rank advises its own mapping of the leader's segment.
+    // madvise needs page boundaries, the partial pages at either end stay as they are
+    if (ARENA_HUGEPAGES >= 1 && size > 0) {
+        uintptr_t page = sysconf(_SC_PAGE_SIZE);
+        uintptr_t first = ((uintptr_t)inputs.base + page - 1) / page * page, last = ((uintptr_t)inputs.base + size) / page * page;
+        if (last > first) madvise((void*)first, last - first, MADV_HUGEPAGE);
+    }
+    // One passive-target epoch for the life of the block, the ranks of a node then synchronize through
+    // MPI_Win_sync and a barrier on nodeComm (see publishSharedInputs)
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, inputs.window);
+#else
+    inputs.local.resize(bytes);
+    inputs.base = inputs.local.data();
+#endif
+
+    long *offsets = (long*)inputs.base;
+    inputs.X.offsets = offsets;
+    inputs.Y.offsets = offsets + NROWS + 1;
+    int *ints = (int*)(offsets + 2 * (NROWS + 1));
+    inputs.X.values = ints;
+    inputs.X.indices = ints + nnzX;
+    inputs.Y.values = ints + 2 * nnzX;
+    inputs.Y.indices = ints + 2 * nnzX + nnzY;
 }
 
-// Flatten compressed matrix and broadcast row sizes first
-void flattenCompressedMatrix(const vector<vector<int>>& matrix, vector<int>& flattened, vector<int>& rowSizes) {
-    for (const auto& row : matrix) {
-        rowSizes.push_back(row.size());
-        flattened.insert(flattened.end(), row.begin(), row.end());
+#ifdef _MPI
+/**
+ * publishSharedInputs
+ * @description make the leader's writes to the block visible to the other ranks of its node, collective on nodeComm
+ */
+void publishSharedInputs(SharedInputs &inputs) {
+    MPI_Win_sync(inputs.window);
+    MPI_Barrier(inputs.nodeComm);
+    MPI_Win_sync(inputs.window);
+}
+
+/**
+ * broadcastLarge
+ * @description MPI_Bcast of a long element count, in pieces of at most 1 GB so every count fits in an int
+ */
+void broadcastLarge(void *buffer, long count, MPI_Datatype type, int root, MPI_Comm comm) {
+    int typeBytes;
+    MPI_Type_size(type, &typeBytes);
+    long chunk = (1L << 30) / typeBytes;
+    for (long first = 0; first < count; first += chunk) {
+        MPI_Bcast((char*)buffer + first * typeBytes, (int)min(chunk, count - first), type, root, comm);
     }
 }
+#endif
+
+/**
+ * releaseSharedInputs
+ * @description free the block and the node communicators, collective under MPI
+ */
+void releaseSharedInputs(SharedInputs &inputs) {
+#ifdef _MPI
+    MPI_Win_unlock_all(inputs.window);
+    MPI_Win_free(&inputs.window);
+    if (inputs.leaderComm != MPI_COMM_NULL) MPI_Comm_free(&inputs.leaderComm);
+    MPI_Comm_free(&inputs.nodeComm);
+#else
+    vector<char, ArenaAllocator<char>>().swap(inputs.local);
+#endif
+    inputs.base = nullptr;
+}
 
-// Reconstruct compressed matrix based on row sizes
-void reconstructCompressedMatrix(vector<vector<int>>& matrix, const vector<int>& flattened, const vector<int>& rowSizes) {
-    int idx = 0;
-    for (int i = 0; i < matrix.size(); ++i) {
-        matrix[i].assign(flattened.begin() + idx, flattened.begin() + idx + rowSizes[i]);
-        idx += rowSizes[i];
+/**
+ * fillCsrMatrix
+ * @description copy compressed rows into flat CSR arrays allocated for the same nnz, only the offsets if
+ * @description the CSR matrix has no values
+ */
+void fillCsrMatrix(const Matrix &values, const Matrix &indices, CsrMatrix &csr) {
+    csr.offsets[0] = 0;
+    for (int i = 0; i < NROWS; i++) csr.offsets[i + 1] = csr.offsets[i] + values[i].size();
+    if (csr.values == nullptr) return;
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < NROWS; i++) {
+        copy(values[i].begin(), values[i].end(), csr.values + csr.offsets[i]);
+        copy(indices[i].begin(), indices[i].end(), csr.indices + csr.offsets[i]);
     }
 }
 
+/**
+ * writeResultBinary
+ * @description write the result as one binary CSR file, each rank writing its own rows and each thread packing
+ * @description its share of them, all at offsets computed up front. Layout, little-endian:
+ * @description "SPMXCSR1", int64 nRows, int64 nCols, int64 nnz, int64 rowOffsets[nRows + 1], int32 indices[nnz],
+ * @description int32 values[nnz]. Without MPI the threads pwrite their parts, with MPI the ranks use collective MPI-IO
+ * @param path {string} file to write
+ * @param dense {Matrix*} dense result rows, row i held by dense[i - denseFirstRow], nullptr for compressed rows
+ * @param denseFirstRow {int} row of the full result held by dense[0]
+ * @param values {Matrix*} compressed result rows start_row to end_row, used when dense is nullptr
+ * @param indices {Matrix*} column indices of the compressed rows
+ * @param start_row {int} first row written by this rank, the ranks' row ranges follow each other in rank order
+ * @param end_row {int} one past the last row written by this rank
+ * @return {long} bytes written by all ranks, -1 on error
+ */
+long writeResultBinary(const string &path, const Matrix *dense, int denseFirstRow, const Matrix *values, const Matrix *indices,
+                       int start_row, int end_row, int rank, int nProcesses) {
+    int localRows = end_row - start_row;
+
+    // 1. nnz of every local row, then their positions in the local arrays
+    vector<long> rowStart(localRows + 1, 0);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (int r = 0; r < localRows; r++) {
+        if (dense != nullptr) {
+            const Row &row = (*dense)[start_row + r - denseFirstRow];
+            rowStart[r + 1] = row.size() - count(row.begin(), row.end(), 0);
+        } else {
+            rowStart[r + 1] = (*values)[r].size();
+        }
+    }
+    for (int r = 0; r < localRows; r++) rowStart[r + 1] += rowStart[r];
+    long localNnz = rowStart[localRows];
+
+    // 2. nnz before this rank's rows and in total
+    long nnzBefore = 0, totalNnz = localNnz;
+#ifdef _MPI
+    MPI_Exscan(&localNnz, &nnzBefore, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) nnzBefore = 0;
+    MPI_Allreduce(&localNnz, &totalNnz, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+
+    // 3. This rank's part of each section, packed by the threads row by row
+    bool lastRank = rank == nProcesses - 1;
+    vector<long> outOffsets(localRows + (lastRank ? 1 : 0));
+    vector<int> outIndices(localNnz), outValues(localNnz);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (int r = 0; r < localRows; r++) {
+        outOffsets[r] = nnzBefore + rowStart[r];
+        long pos = rowStart[r];
+        if (dense != nullptr) {
+            const Row &row = (*dense)[start_row + r - denseFirstRow];
+            for (int col = 0; col < (int)row.size(); col++) {
+                if (row[col] != 0) {
+                    outIndices[pos] = col;
+                    outValues[pos++] = row[col];
+                }
+            }
+        } else {
+            copy((*indices)[r].begin(), (*indices)[r].end(), outIndices.begin() + pos);
+            copy((*values)[r].begin(), (*values)[r].end(), outValues.begin() + pos);
+        }
+    }
+    if (lastRank) outOffsets[localRows] = totalNnz;
+
+    long header[4];
+    memcpy(header, "SPMXCSR1", 8);
+    header[1] = NROWS;
+    header[2] = NCOLS;
+    header[3] = totalNnz;
+    long offsetsPos = sizeof(header) + (long)start_row * sizeof(long);
+    long indicesPos = sizeof(header) + (NROWS + 1L) * sizeof(long) + nnzBefore * sizeof(int);
+    long valuesPos = indicesPos + totalNnz * sizeof(int);
+    long fileBytes = sizeof(header) + (NROWS + 1L) * sizeof(long) + 2 * totalNnz * sizeof(int);
+
+    // 4. Write the sections at their offsets
+    struct Section {
+        long position;
+        const char *data;
+        long bytes;
+    };
+    vector<Section> sections = {
+        {offsetsPos, (const char*)outOffsets.data(), (long)(outOffsets.size() * sizeof(long))},
+        {indicesPos, (const char*)outIndices.data(), (long)(localNnz * sizeof(int))},
+        {valuesPos, (const char*)outValues.data(), (long)(localNnz * sizeof(int))},
+    };
+    if (rank == 0) sections.push_back({0, (const char*)header, (long)sizeof(header)});
+
+#ifdef _MPI
+    MPI_File file;
+    int error = MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+    if (error != MPI_SUCCESS) {
+        if (rank == 0) cerr << "Error opening files!" << endl;
+        return -1;
+    }
+    MPI_File_set_size(file, fileBytes);
+    // collective writes in chunks that fit an int count, every rank joins as many rounds as the largest section needs
+    const long CHUNK = 1L << 30;
+    for (int i = 0; i < 3; i++) {
+        long rounds = (sections[i].bytes + CHUNK - 1) / CHUNK, maxRounds;
+        MPI_Allreduce(&rounds, &maxRounds, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+        for (long round = 0; round < maxRounds; round++) {
+            long done = round * CHUNK;
+            int bytes = (int)max(0L, min(CHUNK, sections[i].bytes - done));
+            MPI_File_write_at_all(file, sections[i].position + (bytes > 0 ? done : 0), sections[i].data + (bytes > 0 ? done : 0), bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        }
+    }
+    if (rank == 0) MPI_File_write_at(file, 0, header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+#else
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, fileBytes) != 0) {
+        cerr << "Error opening files!" << endl;
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    // every thread writes an equal slice of every section
+    bool failed = false;
+#ifdef _OPENMP
+    #pragma omp parallel reduction(||:failed)
+#endif
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num(), nThreads = omp_get_num_threads();
+#else
+        int t = 0, nThreads = 1;
+#endif
+        for (const Section &section : sections) {
+            long first = section.bytes * t / nThreads, last = section.bytes * (t + 1) / nThreads;
+            while (first < last) {
+                ssize_t written = pwrite(fd, section.data + first, last - first, section.position + first);
+                if (written <= 0) {
+                    failed = true;
+                    break;
+                }
+                first += written;
+            }
+        }
+    }
+    close(fd);
+    if (failed) {
+        cerr << "Error writing " << path << endl;
+        return -1;
+    }
+#endif
+    return fileBytes;
+}
+
+#ifdef _MPI
+/**
+ * YSlices
+ * @description the rows of Y a rank holds when Y is distributed: the slice in use and the one arriving next,
+ * @description slice k being the rows localRowRange gives rank k
+ */
+struct YSlices {
+    vector<int> values[2], indices[2];
+    vector<long> offsets; // offsets of the slice in use, rebased to its first entry, for its rows only
+};
+
+/**
+ * postLarge
+ * @description MPI_Isend or MPI_Irecv of a long element count, in pieces of at most 1 GB so every count fits in an int.
+ * @description Pieces between the same two ranks match in the order they were posted
+ */
+void postLarge(bool send, void *buffer, long count, MPI_Datatype type, int peer, vector<MPI_Request> &requests) {
+    int typeBytes;
+    MPI_Type_size(type, &typeBytes);
+    long chunk = (1L << 30) / typeBytes;
+    for (long first = 0; first < count; first += chunk) {
+        MPI_Request request;
+        // tag 1, tag 0 is the result gather
+        if (send) {
+            MPI_Isend((char*)buffer + first * typeBytes, (int)min(chunk, count - first), type, peer, 1, MPI_COMM_WORLD, &request);
+        } else {
+            MPI_Irecv((char*)buffer + first * typeBytes, (int)min(chunk, count - first), type, peer, 1, MPI_COMM_WORLD, &request);
+        }
+        requests.push_back(request);
+    }
+}
+
+/**
+ * scatterYSlices
+ * @description rank 0 sends every rank its own slice of the generated Y, one rank at a time
+ * @param Yoffsets {long*} row offsets of the whole Y
+ */
+void scatterYSlices(const Matrix &Yvalues, const Matrix &Yindices, const long *Yoffsets, YSlices &slices, int rank, int nProcesses) {
+    // rank 0 packs its own slice last, so its buffer ends up holding it
+    for (int step = 1; step <= nProcesses; step++) {
+        int target = step % nProcesses;
+        if (rank != 0 && rank != target) continue;
+        int first_row, last_row;
+        localRowRange(target, nProcesses, first_row, last_row);
+        long count = Yoffsets[last_row] - Yoffsets[first_row];
+        slices.values[0].resize(count);
+        slices.indices[0].resize(count);
+        if (rank == 0) {
+            for (int row = first_row; row < last_row; row++) {
+                copy(Yvalues[row].begin(), Yvalues[row].end(), slices.values[0].begin() + (Yoffsets[row] - Yoffsets[first_row]));
+                copy(Yindices[row].begin(), Yindices[row].end(), slices.indices[0].begin() + (Yoffsets[row] - Yoffsets[first_row]));
+            }
+        }
+        if (target == 0) continue;
+        vector<MPI_Request> requests;
+        postLarge(rank == 0, slices.values[0].data(), count, MPI_INT, rank == 0 ? target : 0, requests);
+        postLarge(rank == 0, slices.indices[0].data(), count, MPI_INT, rank == 0 ? target : 0, requests);
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    }
+}
+
+/**
+ * ringMatrixMultiply
+ * @description multiply this rank's rows of X by Y distributed in slices: at step s the rank holds slice
+ * @description rank + s, multiplies by it while receiving slice rank + s + 1 from rank + 1 and passing its
+ * @description slice on to rank - 1, so after nProcesses steps every row of Y has been used once
+ * @param Yoffsets {long*} row offsets of the whole Y
+ * @param slices {YSlices} buffers holding this rank's own slice on entry
+ */
+void ringMatrixMultiply(const CsrMatrix& X, const long *Yoffsets, YSlices &slices, Strategy strategy, Matrix& result, int resultFirstRow,
+                        Matrix& resultValues, Matrix& resultIndices, int rank, int nProcesses) {
+    slices.offsets.resize(NROWS + 1);
+    for (int step = 0; step < nProcesses; step++) {
+        int current = step % 2, next = 1 - current;
+        vector<MPI_Request> requests;
+        if (step + 1 < nProcesses) {
+            int next_first, next_last;
+            localRowRange((rank + step + 1) % nProcesses, nProcesses, next_first, next_last);
+            long count = Yoffsets[next_last] - Yoffsets[next_first];
+            slices.values[next].resize(count);
+            slices.indices[next].resize(count);
+            int from = (rank + 1) % nProcesses, to = (rank + nProcesses - 1) % nProcesses;
+            postLarge(false, slices.values[next].data(), count, MPI_INT, from, requests);
+            postLarge(false, slices.indices[next].data(), count, MPI_INT, from, requests);
+            postLarge(true, slices.values[current].data(), slices.values[current].size(), MPI_INT, to, requests);
+            postLarge(true, slices.indices[current].data(), slices.indices[current].size(), MPI_INT, to, requests);
+        }
+
+        int first_row, last_row;
+        localRowRange((rank + step) % nProcesses, nProcesses, first_row, last_row);
+        for (int row = first_row; row <= last_row; row++) slices.offsets[row] = Yoffsets[row] - Yoffsets[first_row];
+        CsrMatrix Y = {slices.offsets.data(), slices.values[current].data(), slices.indices[current].data()};
+        if (strategy == SPARSE_DISTRIBUTED) {
+            sparseMatrixMultiply(X, Y, first_row, last_row, resultValues, resultIndices, step > 0, rank, nProcesses);
+        } else {
+            compressedMatrixMultiply(X, Y, first_row, last_row, result, resultFirstRow, false, rank, nProcesses);
+        }
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    }
+    if (strategy == DENSE_GATHER) gatherDenseResult(result, resultFirstRow, rank, nProcesses);
+}
+#endif
+
+/**
+ * Workspace
+ * @description buffers of one experiment, kept between runs so repeated experiments reuse their capacity
+ */
+struct Workspace {
+    Matrix Xvalues, Xindices; // generated on rank 0 only
+    Matrix Yvalues, Yindices;
+    Matrix result; // Resulting matrix, dense rows
+    Matrix resultValues, resultIndices; // Resulting matrix, compressed rows
+
+    // Indices are broadcast delta-encoded between nodes, held only until the leaders have decoded them
+    PackedIndices packed_Xindices, packed_Yindices;
+#ifdef _MPI
+    YSlices slices; // this rank's part of a distributed Y
+#endif
+};
+
 /**
  * startExperiment
  * @description Time the entire experiment, and write matrices if in debug mode
+ * @param ws {Workspace}, buffers for the matrices, reused if they come from an earlier run
  * @param rank {int}, MPI rank
  * @param nProcesses {int}, Number of MPI processes
  * @param nThreads {int}, Number of OpenMP threads
  * @param percent {int}, Density of non-zero elements
+ * @param budget {MemoryBudget}, memory available to each rank, decides the plan
+ * @return {double} elapsed time of the multiplication in seconds, -1 if no strategy fits in memory
  */
-void startExperiment(int rank, int nProcesses, int nThreads, int percent) {
-    vector<vector<int>> Xvalues, Xindices;
-    vector<vector<int>> Yvalues, Yindices;
-    vector<vector<int>> result(NROWS, vector<int>(NCOLS, 0)); // Resulting matrix
-
-    // Flatten matrices for broadcast messaging sending
-    vector<int> flattened_Xvalues, flattened_Xindices;
-    vector<int> flattened_Yvalues, flattened_Yindices;
+double startExperiment(Workspace &ws, int rank, int nProcesses, int nThreads, int percent, const MemoryBudget &budget) {
+    Matrix &Xvalues = ws.Xvalues, &Xindices = ws.Xindices;
+    Matrix &Yvalues = ws.Yvalues, &Yindices = ws.Yindices;
+#ifdef _MPI
+    PackedIndices &packed_Xindices = ws.packed_Xindices, &packed_Yindices = ws.packed_Yindices;
+#endif
 
-    // rowSizes Information for flattened matrices
-    vector<int> rowSizes_Xvalues, rowSizes_Xindices;
-    vector<int> rowSizes_Yvalues, rowSizes_Yindices;
+    Matrix &result = ws.result;
 
+    // rank 0 plans before anything is allocated: inputs from the density, the result from a sample of the inputs
+    Plan plan;
     if (rank == 0) {
-        cout << "==================Generating Matrices====================" << endl;
-        // Generate compressed matrices with target matrix size and density
-        generateMatrices(Xvalues, Xindices, percent, rank, nProcesses);
-        generateMatrices(Yvalues, Yindices, percent, rank, nProcesses);
-        cout << "==================Mutiplying Matrices====================" << endl;
-
-        flattenCompressedMatrix(Xvalues, flattened_Xvalues, rowSizes_Xvalues);
-        flattenCompressedMatrix(Xindices, flattened_Xindices, rowSizes_Xindices);
-        flattenCompressedMatrix(Yvalues, flattened_Yvalues, rowSizes_Yvalues);
-        flattenCompressedMatrix(Yindices, flattened_Yindices, rowSizes_Yindices);
+        double analyticInputBytes = inputBytes(analyticEstimate(percent), budget.ranksPerNode, nProcesses, nProcesses > 1);
+        if (analyticInputBytes > 0.9 * budget.bytesPerRank) {
+            cout << "The inputs alone need " << analyticInputBytes / (1UL << 30) << " GB per rank, which does not fit" << endl;
+        } else {
+            cout << "==================Generating Matrices====================" << endl;
+            // Generate compressed matrices with target matrix size and density
+            generateMatrices(Xvalues, Xindices, percent, rank, nProcesses);
+            generateMatrices(Yvalues, Yindices, percent, rank, nProcesses);
+            plan = choosePlan(sampledEstimate(Xindices, Yindices, 256), nProcesses, nThreads, budget, RESULT_ON_ROOT);
+        }
     }
+#ifdef _MPI
+    int planFields[2] = {plan.strategy, plan.distributedY};
+    MPI_Bcast(planFields, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    plan.strategy = (Strategy)planFields[0];
+    plan.distributedY = planFields[1];
+#endif
+    Strategy strategy = plan.strategy;
+    if (strategy == NO_STRATEGY) return -1;
 
-    // Broadcast generated matrices to all processes
-    // 1. Broadcast row sizes first
-    if (rank != 0) {
-        rowSizes_Xvalues.resize(NROWS);
-        rowSizes_Xindices.resize(NROWS);
-        rowSizes_Yvalues.resize(NROWS);
-        rowSizes_Yindices.resize(NROWS);
+    // nnz of X and Y, which size the shared block
+    long nnz[2] = {0, 0};
+    if (rank == 0) {
+        cout << "==================Mutiplying Matrices====================" << endl;
+        for (int i = 0; i < NROWS; i++) {
+            nnz[0] += Xvalues[i].size();
+            nnz[1] += Yvalues[i].size();
+        }
     }
+#ifdef _MPI
+    MPI_Bcast(nnz, 2, MPI_LONG, 0, MPI_COMM_WORLD);
+#endif
 
-    MPI_Bcast(rowSizes_Xvalues.data(), NROWS, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(rowSizes_Xindices.data(), NROWS, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(rowSizes_Yvalues.data(), NROWS, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(rowSizes_Yindices.data(), NROWS, MPI_INT, 0, MPI_COMM_WORLD);
-
-    // Resize matrices to receive broadcast data
-    if (rank != 0) {
-        Xvalues.resize(NROWS);
-        Xindices.resize(NROWS);
-        Yvalues.resize(NROWS);
-        Yindices.resize(NROWS);
+    SharedInputs inputs;
+    allocateSharedInputs(inputs, nnz[0], plan.distributedY ? 0 : nnz[1], rank);
+    CsrMatrix &X = inputs.X, &Y = inputs.Y;
+    if (plan.distributedY) Y.values = Y.indices = nullptr;
+    if (rank == 0) {
+        fillCsrMatrix(Xvalues, Xindices, X);
+        fillCsrMatrix(Yvalues, Yindices, Y);
     }
 
-    // Calculate the total size of the flattened matrices for each process
-    int flattened_Xvalues_size = 0;
-    int flattened_Xindices_size = 0;
-    int flattened_Yvalues_size = 0;
-    int flattened_Yindices_size = 0;
+#ifdef _MPI
+    // Broadcast the generated matrices to one leader per node, straight into the node's shared block.
+    // On a single node rank 0 has filled the block itself and there is nothing to send
+    int nLeaders = 0;
+    if (inputs.leaderComm != MPI_COMM_NULL) MPI_Comm_size(inputs.leaderComm, &nLeaders);
+    if (nLeaders > 1) {
+        if (rank == 0) {
+            packIndices(Xindices, packed_Xindices);
+            if (!plan.distributedY) packIndices(Yindices, packed_Yindices);
+        }
 
-    for (int i = 0; i < NROWS; ++i) {
-        flattened_Xvalues_size += rowSizes_Xvalues[i];
-        flattened_Xindices_size += rowSizes_Xindices[i];
-        flattened_Yvalues_size += rowSizes_Yvalues[i];
-        flattened_Yindices_size += rowSizes_Yindices[i];
-    }
+        // 1. Broadcast the row offsets of X and Y (contiguous) and the packed row offsets first
+        // A distributed Y only needs its offsets here, its rows go to their ranks afterwards
+        if (rank != 0) {
+            packed_Xindices.offsets.resize(NROWS + 1);
+            if (!plan.distributedY) packed_Yindices.offsets.resize(NROWS + 1);
+        }
+        broadcastLarge(X.offsets, 2 * (NROWS + 1), MPI_LONG, 0, inputs.leaderComm);
+        broadcastLarge(packed_Xindices.offsets.data(), NROWS + 1, MPI_LONG, 0, inputs.leaderComm);
+        if (!plan.distributedY) broadcastLarge(packed_Yindices.offsets.data(), NROWS + 1, MPI_LONG, 0, inputs.leaderComm);
 
-    // Resize flattened matrices on non-rank 0 processes
-    if (rank != 0) {
-        flattened_Xvalues.resize(flattened_Xvalues_size);
-        flattened_Xindices.resize(flattened_Xindices_size);
-        flattened_Yvalues.resize(flattened_Yvalues_size);
-        flattened_Yindices.resize(flattened_Yindices_size);
-    }
+        if (rank != 0) {
+            packed_Xindices.bytes.resize(packed_Xindices.offsets[NROWS]);
+            if (!plan.distributedY) packed_Yindices.bytes.resize(packed_Yindices.offsets[NROWS]);
+        }
 
-    // 2. Broadcast flattened matrices
-    MPI_Bcast(flattened_Xvalues.data(), flattened_Xvalues.size(), MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(flattened_Xindices.data(), flattened_Xindices.size(), MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(flattened_Yvalues.data(), flattened_Yvalues.size(), MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(flattened_Yindices.data(), flattened_Yindices.size(), MPI_INT, 0, MPI_COMM_WORLD);
+        // 2. Broadcast values and packed indices, nnz and the packed sizes can pass 2^31 on large inputs
+        broadcastLarge(X.values, nnz[0], MPI_INT, 0, inputs.leaderComm);
+        broadcastLarge(packed_Xindices.bytes.data(), packed_Xindices.bytes.size(), MPI_BYTE, 0, inputs.leaderComm);
+        if (!plan.distributedY) {
+            broadcastLarge(Y.values, nnz[1], MPI_INT, 0, inputs.leaderComm);
+            broadcastLarge(packed_Yindices.bytes.data(), packed_Yindices.bytes.size(), MPI_BYTE, 0, inputs.leaderComm);
+        }
 
-    // Reconstruct compressed matrices based on rowSizes
-    if (rank != 0) {
-        reconstructCompressedMatrix(Xvalues, flattened_Xvalues, rowSizes_Xvalues);
-        reconstructCompressedMatrix(Xindices, flattened_Xindices, rowSizes_Xindices);
-        reconstructCompressedMatrix(Yvalues, flattened_Yvalues, rowSizes_Yvalues);
-        reconstructCompressedMatrix(Yindices, flattened_Yindices, rowSizes_Yindices);
+        // Decode the indices into the shared block
+        if (rank != 0) {
+            unpackIndices(packed_Xindices, X.offsets, X.indices);
+            if (!plan.distributedY) unpackIndices(packed_Yindices, Y.offsets, Y.indices);
+        }
+        packed_Xindices = PackedIndices();
+        packed_Yindices = PackedIndices();
     }
+    // The other ranks of the node read the block once the leader has filled it
+    publishSharedInputs(inputs);
+    if (plan.distributedY) scatterYSlices(Yvalues, Yindices, Y.offsets, ws.slices, rank, nProcesses);
+#endif
 
 #ifdef _OPENMP
     omp_set_num_threads(nThreads);
 #endif
 
+    // Resulting matrix, zeroed in place and only as large as the strategy needs
+    int start_row, end_row;
+    localRowRange(rank, nProcesses, start_row, end_row);
+    if (strategy == DENSE_GATHER) {
+        // rank 0 receives every row, the others only hold their own
+        result.resize(NROWS);
+        for (int row = 0; row < NROWS; row++) {
+            if (rank == 0 || (row >= start_row && row < end_row)) {
+                result[row].assign(NCOLS, 0);
+            } else {
+                Row().swap(result[row]);
+            }
+        }
+    } else if (strategy == DENSE_DISTRIBUTED) {
+        result.resize(end_row - start_row);
+        for (Row &row : result) row.assign(NCOLS, 0);
+    }
+
     auto start = std::chrono::high_resolution_clock::now();
     // Matrix multiplication
-    compressedMatrixMultiply(Xvalues, Xindices, Yvalues, Yindices, result, rank, nProcesses);
+    int resultFirstRow = strategy == DENSE_GATHER ? 0 : start_row;
+    if (plan.distributedY) {
+#ifdef _MPI
+        ringMatrixMultiply(X, Y.offsets, ws.slices, strategy, result, resultFirstRow, ws.resultValues, ws.resultIndices, rank, nProcesses);
+#endif
+    } else if (strategy == SPARSE_DISTRIBUTED) {
+        sparseMatrixMultiply(X, Y, 0, NROWS, ws.resultValues, ws.resultIndices, false, rank, nProcesses);
+    } else {
+        compressedMatrixMultiply(X, Y, 0, NROWS, result, resultFirstRow, strategy == DENSE_GATHER, rank, nProcesses);
+    }
 
     // Synchronize before time measurement
 #ifdef _MPI
@@ -260,6 +1301,7 @@ void startExperiment(int rank, int nProcesses, int nThreads, int percent) {
     time_t end_time = std::chrono::system_clock::to_time_t(end);
     std::chrono::duration<double> elapsed_time = end - start;
     double elapsed = elapsed_time.count();
+    releaseSharedInputs(inputs);
 
     // Only rank 0 outputs the results
     if (rank == 0) {
@@ -270,16 +1312,117 @@ void startExperiment(int rank, int nProcesses, int nThreads, int percent) {
             string suffix = "_size_" + to_string(NROWS) + "_percent_" + to_string(percent);
             writeMatrixToFile(Xvalues, Xindices, "X" + suffix);
             writeMatrixToFile(Yvalues, Yindices, "Y" + suffix);
-            writeMatrixToFile(result, result, "XY" + suffix);
         }
     }
+
+    // Every rank writes its own result rows, whichever strategy kept them
+    if (WRITE_RESULT) {
+        string path = "FileCSR_matrixXY_size_" + to_string(NROWS) + "_percent_" + to_string(percent);
+        auto writeStart = std::chrono::high_resolution_clock::now();
+        long bytes;
+        if (strategy == SPARSE_DISTRIBUTED) {
+            bytes = writeResultBinary(path, nullptr, 0, &ws.resultValues, &ws.resultIndices, start_row, end_row, rank, nProcesses);
+        } else {
+            bytes = writeResultBinary(path, &result, resultFirstRow, nullptr, nullptr, start_row, end_row, rank, nProcesses);
+        }
+        std::chrono::duration<double> writeTime = std::chrono::high_resolution_clock::now() - writeStart;
+        if (rank == 0 && bytes >= 0) cout << "Result written to " << path << ": " << bytes / (1UL << 20) << " MB in " << writeTime.count() << "s\n";
+    }
+    return elapsed;
 }
 
+/**
+ * fitCostModel
+ * @description least-squares fit of elapsed = a * N^b in log-log space over the last few runs,
+ * @description falls back to the d^2 * N^3 flop count (b = 3) until two usable runs exist
+ * @param sizes {vector<double>} matrix sizes of the runs
+ * @param times {vector<double>} elapsed times of the runs
+ */
+void fitCostModel(const vector<double> &sizes, const vector<double> &times, double &a, double &b) {
+    vector<double> logN, logT;
+    for (int i = max(0, (int)sizes.size() - 4); i < (int)sizes.size(); i++) {
+        // runs under a millisecond are dominated by overhead rather than the multiply
+        if (times[i] >= 1e-3) {
+            logN.push_back(log(sizes[i]));
+            logT.push_back(log(times[i]));
+        }
+    }
+
+    b = 3;
+    if (logN.size() >= 2) {
+        double meanN = 0, meanT = 0, covariance = 0, variance = 0;
+        for (int i = 0; i < (int)logN.size(); i++) {
+            meanN += logN[i] / logN.size();
+            meanT += logT[i] / logN.size();
+        }
+        for (int i = 0; i < (int)logN.size(); i++) {
+            covariance += (logN[i] - meanN) * (logT[i] - meanT);
+            variance += (logN[i] - meanN) * (logN[i] - meanN);
+        }
+        if (variance > 0) b = min(4.0, max(1.0, covariance / variance));
+    }
+    // anchor the curve on the latest run
+    a = times.back() / pow(sizes.back(), b);
+}
+
+/**
+ * startScalingSweep
+ * @description Grow the matrix size geometrically in one job, reusing the same buffers, until the fitted cost
+ * @description model predicts the multiplication would exceed the time budget, then report the largest size that fits
+ * @param budget {double}, time budget of one multiplication in seconds
+ * @param startSize {int}, size of the first run
+ * @param growth {double}, factor the size grows by between runs
+ * @param memory {MemoryBudget}, memory available to each rank
+ */
+void startScalingSweep(int rank, int nProcesses, int nThreads, int percent, double budget, int startSize, double growth, const MemoryBudget &memory) {
+    Workspace ws;
+    vector<double> sizes, times;
+    double a = 0, b = 3;
+    int largestFit = 0;
+    int nSize = startSize;
+
+    while (nSize > 0) {
+        NROWS = NCOLS = nSize;
+        if (rank == 0) cout << "<<<<<<<<<< Scaling run with matrix size: " << nSize << " >>>>>>>>>>" << endl;
+        double elapsed = startExperiment(ws, rank, nProcesses, nThreads, percent, memory);
+
+        // rank 0 decides the next size, 0 ends the sweep
+        int nextSize = 0;
+        if (rank == 0 && elapsed < 0) {
+            cout << "Matrix size " << nSize << " does not fit in memory, stopping" << endl;
+        } else if (rank == 0) {
+            sizes.push_back(nSize);
+            times.push_back(elapsed);
+            fitCostModel(sizes, times, a, b);
+            double predictedFit = a > 0 ? pow(budget / a, 1.0 / b) : nSize * growth;
+            cout << "Cost model: elapsed = " << a << " * N^" << b << ", largest size predicted within budget: " << (long)predictedFit << endl;
+
+            if (elapsed <= budget) {
+                largestFit = nSize;
+                // grow geometrically, but do not step past the predicted limit
+                double candidate = min(min(nSize * growth, predictedFit), 1e9);
+                if (candidate > nSize * 1.01) nextSize = (int)candidate;
+            }
+        }
+#ifdef _MPI
+        MPI_Bcast(&nextSize, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+        nSize = nextSize;
+    }
+
+    if (rank == 0) {
+        cout << "==================Scaling Result====================" << endl;
+        cout << "Largest measured size within " << budget << "s: " << (largestFit > 0 ? to_string(largestFit) : "none") << endl;
+        if (a > 0) cout << "Largest size predicted by the cost model: " << (long)pow(budget / a, 1.0 / b) << endl;
+    }
+}
+
+#ifdef _MPI
 /**
  * broadcastMatrix
  * @description Broadcast matrices to all MPI processes
  */
-void broadcastMatrix(vector<vector<int>>& values, vector<vector<int>>& indices, int rank) {
+void broadcastMatrix(Matrix& values, Matrix& indices, int rank) {
     // Flatten the matrix so we can sent MPI broadcast
     int value_size = values.size() * NCOLS;
     int index_size = indices.size() * NCOLS;
@@ -288,7 +1431,7 @@ void broadcastMatrix(vector<vector<int>>& values, vector<vector<int>>& indices,
     vector<int> flat_indices(index_size);
 
     if (rank == 0) {
-        for (int i = 0; i < values.size(); i++) {
+        for (int i = 0; i < (int)values.size(); i++) {
             copy(values[i].begin(), values[i].end(), flat_values.begin() + i * NCOLS);
             copy(indices[i].begin(), indices[i].end(), flat_indices.begin() + i * NCOLS);
         }
@@ -312,6 +1455,184 @@ void broadcastMatrix(vector<vector<int>>& values, vector<vector<int>>& indices,
         }
     }
 }
+#endif
+
+/**
+ * NodeTopology
+ * @description sockets, NUMA domains and physical cores of the CPUs this process may run on, read from /sys
+ */
+struct NodeTopology {
+    vector<int> cpus; // CPUs in the affinity mask
+    map<int, int> socketOf, numaOf, coreOf; // per usable CPU, coreOf numbers the physical cores across sockets
+    int nSockets = 0, nNumaNodes = 0, nCores = 0;
+};
+
+int readSysInt(const string &path, int fallback) {
+    ifstream in(path);
+    int value;
+    return (in >> value) ? value : fallback;
+}
+
+// CPUs of a list such as "0-3,8-11"
+vector<int> parseCpuList(const string &list) {
+    vector<int> cpus;
+    stringstream in(list);
+    string range;
+    while (getline(in, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/**
+ * detectTopology
+ * @description topology of the CPUs in this process's affinity mask, or of every online CPU of the node. Without
+ * @description NUMA information every socket counts as one domain
+ * @param wholeNode {bool} take every CPU in /sys/devices/system/cpu/online, so a probe launched on a single CPU
+ * @param wholeNode still sees the node it has to plan for
+ */
+NodeTopology detectTopology(bool wholeNode) {
+    NodeTopology topo;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    sched_getaffinity(0, sizeof(mask), &mask);
+    if (wholeNode) {
+        ifstream in("/sys/devices/system/cpu/online");
+        string list;
+        if (getline(in, list) && !list.empty()) {
+            CPU_ZERO(&mask);
+            for (int cpu : parseCpuList(list)) if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &mask);
+        }
+    }
+
+    map<pair<int, int>, int> coreIds;
+    set<int> sockets;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &mask)) continue;
+        string dir = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/";
+        int socket = readSysInt(dir + "physical_package_id", 0);
+        int core = readSysInt(dir + "core_id", cpu);
+        // hardware threads of one core share an id
+        pair<int, int> key(socket, core);
+        if (!coreIds.count(key)) coreIds[key] = coreIds.size();
+        topo.cpus.push_back(cpu);
+        topo.socketOf[cpu] = socket;
+        topo.coreOf[cpu] = coreIds[key];
+        topo.numaOf[cpu] = socket;
+        sockets.insert(socket);
+    }
+
+    set<int> numaNodes;
+    DIR *nodeDir = opendir("/sys/devices/system/node");
+    if (nodeDir != nullptr) {
+        while (dirent *entry = readdir(nodeDir)) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+            ifstream in(string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            string list;
+            getline(in, list);
+            for (int cpu : parseCpuList(list)) {
+                if (topo.numaOf.count(cpu)) topo.numaOf[cpu] = node;
+            }
+        }
+        closedir(nodeDir);
+    }
+    for (auto &entry : topo.numaOf) numaNodes.insert(entry.second);
+
+    topo.nSockets = sockets.size();
+    topo.nNumaNodes = numaNodes.size();
+    topo.nCores = coreIds.size();
+    return topo;
+}
+
+/**
+ * recommendPlacement
+ * @description one rank per NUMA domain, so each rank's threads share its memory controller, and one thread per
+ * @description physical core of that domain
+ */
+void recommendPlacement(const NodeTopology &topo, int &ranksPerNode, int &threadsPerRank) {
+    ranksPerNode = max(1, topo.nNumaNodes);
+    threadsPerRank = max(1, topo.nCores / ranksPerNode);
+}
+
+string joinSet(const set<int> &items) {
+    string joined;
+    for (int item : items) joined += (joined.empty() ? "" : ",") + to_string(item);
+    return joined;
+}
+
+/**
+ * reportBinding
+ * @description print, for every rank, the CPUs its OpenMP threads run on, the sockets and NUMA domains they cover
+ * @description and whether each thread is pinned, with warnings for domains spanned and CPUs shared
+ * @param nodeComm {MPI_Comm} ranks of this node, to find CPUs used by more than one rank (MPI only)
+ */
+#ifdef _MPI
+void reportBinding(const NodeTopology &topo, int rank, int nProcesses, int nThreads, MPI_Comm nodeComm) {
+#else
+void reportBinding(const NodeTopology &topo, int rank, int nProcesses, int nThreads) {
+#endif
+    vector<int> threadCpu(nThreads, -1), threadWidth(nThreads, 0);
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nThreads)
+#endif
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num();
+#else
+        int t = 0;
+#endif
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        sched_getaffinity(0, sizeof(mask), &mask);
+        threadCpu[t] = sched_getcpu();
+        threadWidth[t] = CPU_COUNT(&mask);
+    }
+
+    set<int> cpus, sockets, numaNodes;
+    for (int cpu : threadCpu) {
+        cpus.insert(cpu);
+        sockets.insert(topo.socketOf.count(cpu) ? topo.socketOf.at(cpu) : -1);
+        numaNodes.insert(topo.numaOf.count(cpu) ? topo.numaOf.at(cpu) : -1);
+    }
+    int maxWidth = *max_element(threadWidth.begin(), threadWidth.end());
+
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    ostringstream line;
+    line << "rank " << rank << " on " << host << ": " << nThreads << " threads on cpus " << joinSet(cpus)
+         << " (socket " << joinSet(sockets) << ", NUMA " << joinSet(numaNodes) << "), "
+         << (maxWidth == 1 ? "each pinned to one cpu" : "free to move across up to " + to_string(maxWidth) + " cpus");
+    if (numaNodes.size() > 1) line << " WARNING: spans NUMA domains";
+    if ((int)cpus.size() < nThreads) line << " WARNING: threads share cpus";
+
+#ifdef _MPI
+    // count the ranks of this node running on each CPU
+    vector<int> users(CPU_SETSIZE, 0), allUsers(CPU_SETSIZE);
+    for (int cpu : cpus) if (cpu >= 0 && cpu < CPU_SETSIZE) users[cpu] = 1;
+    MPI_Allreduce(users.data(), allUsers.data(), CPU_SETSIZE, MPI_INT, MPI_SUM, nodeComm);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE && allUsers[cpu] > 1) {
+            line << " WARNING: cpus shared with another rank";
+            break;
+        }
+    }
+
+    const int LINE = 512;
+    vector<char> mine(LINE, 0), all(rank == 0 ? (size_t)LINE * nProcesses : 0);
+    strncpy(mine.data(), line.str().c_str(), LINE - 1);
+    MPI_Gather(mine.data(), LINE, MPI_CHAR, all.data(), LINE, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < nProcesses; r++) cout << &all[(size_t)r * LINE] << endl;
+    }
+#else
+    cout << line.str() << endl;
+#endif
+}
 
 int main(int argc, char *argv[]) {
     int nSize = 10000; // Default matrix size
@@ -321,28 +1642,93 @@ int main(int argc, char *argv[]) {
     int nThreads = 1;  // OpenMP threads
 
 #ifdef _MPI
+#ifdef _OPENMP
+    // MPI is only called outside parallel regions, by the thread that initialized it
+    int threadLevel = MPI_THREAD_SINGLE;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threadLevel);
+#else
     MPI_Init(&argc, &argv);
+#endif
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &nProcesses);
-    MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN); // Error handling
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN); // Error handling
+#ifdef _OPENMP
+    if (rank == 0 && threadLevel < MPI_THREAD_FUNNELED) cout << "WARNING: MPI only provides thread level " << threadLevel << ", OpenMP threads may not be safe" << endl;
+#endif
 #endif
 
+    if (argc >= 2 && string(argv[1]) == "topology") {
+        // Describe this node and the placement to launch with, the last line is read by project2.sh
+        if (rank == 0) {
+            NodeTopology topo = detectTopology(true);
+            int ranksPerNode, threadsPerRank;
+            recommendPlacement(topo, ranksPerNode, threadsPerRank);
+            cout << "CPUs: " << topo.cpus.size() << " cores: " << topo.nCores << " sockets: " << topo.nSockets << " NUMA domains: " << topo.nNumaNodes << endl;
+            cout << ranksPerNode << " " << threadsPerRank << endl;
+        }
+#ifdef _MPI
+        MPI_Finalize();
+#endif
+        return 0;
+    }
+
     // Check command-line arguments
    if (argc < 3) {
-        cout << "Usage: %s [nSize] [percent] [nThreads(OpenMP enabled)] \n" << endl;
+        cout << "Usage: %s [nSize] [percent] [nThreads(OpenMP enabled)] [memGB] \n" << endl;
+        cout << "       %s scale [budget(seconds)] [percent] [nThreads(OpenMP enabled)] [startSize] [growth] [memGB] \n" << endl;
+        cout << "       %s plan [nSize] [percent] [nProcesses] [nThreads] [memGB] [nNodes] \n" << endl;
+        cout << "       %s topology \n" << endl;
         return 1;
     }
-    if (argc > 1) {
+    bool scaling = string(argv[1]) == "scale";
+    double budget = 0, growth = 1.5;
+    double memGB = 0; // memory per node, 0 to take it from slurm or the machine
+    if (string(argv[1]) == "plan") {
+        // Plan a run without running it, from the analytic estimates only
+        if (rank == 0) {
+            NROWS = NCOLS = atoi(argv[2]);
+            percent = argc > 3 ? atoi(argv[3]) : 1;
+            int planProcesses = argc > 4 ? atoi(argv[4]) : 1;
+            int planThreads = argc > 5 ? atoi(argv[5]) : 1;
+            memGB = argc > 6 ? atof(argv[6]) : 0;
+            int nNodes = argc > 7 ? atoi(argv[7]) : 1;
+            choosePlan(analyticEstimate(percent), planProcesses, planThreads, detectMemoryBudget(memGB, (planProcesses + nNodes - 1) / nNodes), RESULT_ON_ROOT);
+        }
+#ifdef _MPI
+        MPI_Finalize();
+#endif
+        return 0;
+    }
+    if (scaling) {
+        budget = atof(argv[2]);
+        if (argc > 3) percent = atoi(argv[3]);
+        if (argc > 4) nThreads = atoi(argv[4]);
+        nSize = argc > 5 ? atoi(argv[5]) : 1000;
+        if (argc > 6) growth = atof(argv[6]);
+        if (argc > 7) memGB = atof(argv[7]);
+        NROWS = NCOLS = nSize;
+    } else {
         nSize = atoi(argv[1]);
         NROWS = NCOLS = nSize;
+        percent = atoi(argv[2]);
+        if (argc > 3) nThreads = atoi(argv[3]);
+        if (argc > 4) memGB = atof(argv[4]);
     }
-    if (argc > 2) percent = atoi(argv[2]);
-    if (argc > 3) nThreads = atoi(argv[3]);
+
+    // Ranks on the same node share its memory
+    int ranksPerNode = 1;
+#ifdef _MPI
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_size(nodeComm, &ranksPerNode);
+#endif
+    MemoryBudget memory = detectMemoryBudget(memGB, ranksPerNode);
 
     // Print matrix setup
     if (rank == 0) {
         cout << "==================Running Project====================" << endl;
         cout << "NROWS: " << NROWS << " NCOLS: " << NCOLS << " Percent: " << percent << endl;
+        if (scaling) cout << "Scaling by " << growth << "x per run within a budget of " << budget << "s" << endl;
     // Print MPI and OPENMP related information
 #ifdef _OPENMP
     #ifdef _MPI
@@ -363,8 +1749,34 @@ int main(int argc, char *argv[]) {
 #endif
     }
 
-    // // Start the experiment
-    startExperiment(rank, nProcesses, nThreads, percent);
+    // Report where the ranks and their threads actually run
+    NodeTopology topo = detectTopology(false);
+    if (rank == 0) {
+        int suggestedRanks, suggestedThreads;
+        recommendPlacement(topo, suggestedRanks, suggestedThreads);
+        cout << "Node: " << topo.nCores << " cores, " << topo.nSockets << " sockets, " << topo.nNumaNodes << " NUMA domains visible to rank 0, suggested "
+             << suggestedRanks << " ranks per node with " << suggestedThreads << " threads each" << endl;
+    }
+#ifdef _MPI
+    reportBinding(topo, rank, nProcesses, nThreads, nodeComm);
+    MPI_Comm_free(&nodeComm);
+#else
+    reportBinding(topo, rank, nProcesses, nThreads);
+#endif
+
+    if (scaling) {
+        // Sizes change every run, rows come from the heap and keep their capacity between runs
+        startScalingSweep(rank, nProcesses, nThreads, percent, budget, nSize, growth, memory);
+    } else {
+        // Back all matrix and result rows with one hugepage arena, released in one step once the experiment is done
+        reserveMatrixArena(percent);
+        {
+            // // Start the experiment
+            Workspace ws;
+            startExperiment(ws, rank, nProcesses, nThreads, percent, memory);
+        }
+        matrixArena.release();
+    }
 
 #ifdef _MPI
     MPI_Finalize();
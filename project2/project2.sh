@@ -6,15 +6,19 @@
 #SBATCH --account=courses0101
 
 # Arguments
-MODE=$1         # Mode: seq, openmp, mpi, or hybrid
+MODE=$1         # Mode: seq, openmp, mpi, hybrid, auto (hybrid placed from the node topology), or plan
 SIZE=$2         # Starting Matrix size (SIZE x SIZE)
 PERCENT=$3      # Matrix percentage
 ARG3=$4         # Threads (OpenMP) or Processes (MPI)
 ARG4=$5         # Threads (OpenMP for hybrid)
+MEMGB=$6        # Memory per node in GB for the execution plan, empty to take it from slurm
 
 # TODO How to run the code
 # sbatch [nNodes] project.sh [mode] [matrix_size] [non-zero density] [nProcesses | nThreads(MPI disabled)] [nThreads(MPI enabled)]
 # e.g. sbatch --nodes=4 project2.sh hybrid 100000 1 4 32
+# Every run prints an execution plan first: the result layout it picked and the --mem it needs.
+# To only print the plan without submitting, e.g. bash project2.sh plan 100000 1 4 32 220
+# auto picks one rank per NUMA domain and one thread per core of it, e.g. sbatch --nodes=4 --exclusive project2.sh auto 100000 1
 
 echo "[SBATCH] Started with MODE=$MODE, SIZE=$SIZE, PERCENT=$PERCENT, ARG3=$ARG3, ARG4=$ARG4"
 
@@ -22,11 +26,14 @@ echo "[SBATCH] Started with MODE=$MODE, SIZE=$SIZE, PERCENT=$PERCENT, ARG3=$ARG3
 export OMP_PROC_BIND=spread  # Ensure threads are spread across cores
 export OMP_PLACES=cores      # Bind each thread to a specific core
 
-# For small increment size
-# INCREMENT=1000
-
 # Compile the program based on different mode
-if [ "$MODE" == "seq" ]; then
+if [ "$MODE" == "plan" ]; then
+    # Plan only, nothing to run in parallel
+    g++ -o project2 project2.c
+    ./project2 plan $SIZE $PERCENT ${ARG3:-1} ${ARG4:-1} ${MEMGB:-0} ${SLURM_NNODES:-1}
+    exit $?
+
+elif [ "$MODE" == "seq" ]; then
     # Sequential mode
     g++ -o project2 project2.c
 
@@ -38,7 +45,7 @@ elif [ "$MODE" == "mpi" ]; then
     # Pure MPI mode
     mpicxx -D_MPI -o project2 project2.c
 
-elif [ "$MODE" == "hybrid" ]; then
+elif [ "$MODE" == "hybrid" ] || [ "$MODE" == "auto" ]; then
     # MPI + OpenMP hybrid mode
     mpicxx -fopenmp -D_MPI -o project2 project2.c
 
@@ -47,35 +54,56 @@ else
     exit 1
 fi
 
-# TODO: To run experiment 1 (matrix size finding), uncomment the while loop and last 4 lines of code)
+# TODO: To run experiment 1 (matrix size finding), set BUDGET to the time budget of one multiply in seconds,
+#       the sweep then starts from SIZE and grows it within this job, e.g. BUDGET=600 sbatch project2.sh openmp 10000 1 64
 # TODO: To run experiment 2 (parallel configuration), submit a job with correct parameters of each setting
 
-# while true; do
-  # Execute based on the mode, reusing the compiled binary
+# Threads per process for each mode
+if [ "$MODE" == "openmp" ]; then
+    THREADS=$ARG3
+elif [ "$MODE" == "hybrid" ]; then
+    THREADS=$ARG4
+elif [ "$MODE" == "auto" ]; then
+    # Ranks per node and threads per rank from the topology of this (first) node, nodes are assumed alike.
+    # The probe gets every CPU of the node, a one-CPU step would otherwise only see that CPU
+    PLACEMENT=$(srun --nodes=1 --ntasks=1 --cpus-per-task=${SLURM_CPUS_ON_NODE:-1} ./project2 topology | tail -1)
+    ARG3=$(echo $PLACEMENT | cut -d' ' -f1)
+    THREADS=$(echo $PLACEMENT | cut -d' ' -f2)
+    echo "[SBATCH] Topology placement: $ARG3 ranks per node, $THREADS threads per rank"
+else
+    THREADS=1
+fi
+
+if [ -n "$BUDGET" ]; then
+    RUN_ARGS="scale $BUDGET $PERCENT $THREADS $SIZE 1.5 ${MEMGB:-0}"
+else
+    RUN_ARGS="$SIZE $PERCENT $THREADS ${MEMGB:-0}"
+fi
+
+# Execute based on the mode, reusing the compiled binary
 if [ "$MODE" == "seq" ]; then
     # Sequential mode
-    srun --time=00:10:00 ./project2 $SIZE $PERCENT
+    srun --time=00:10:00 ./project2 $RUN_ARGS
 
 elif [ "$MODE" == "openmp" ]; then
     # Pure OpenMP mode
-    srun --cpus-per-task=$ARG3 ./project2 $SIZE $PERCENT $ARG3
+    srun --cpus-per-task=$ARG3 ./project2 $RUN_ARGS
 
 elif [ "$MODE" == "mpi" ]; then
     # Pure MPI mode
-    srun --ntasks-per-node=$ARG3 ./project2 $SIZE $PERCENT
+    srun --ntasks-per-node=$ARG3 ./project2 $RUN_ARGS
 
 elif [ "$MODE" == "hybrid" ]; then
     # MPI + OpenMP hybrid mode
-    srun --ntasks-per-node=$ARG3 --cpus-per-task=$ARG4 ./project2 $SIZE $PERCENT $ARG4
+    srun --ntasks-per-node=$ARG3 --cpus-per-task=$ARG4 ./project2 $RUN_ARGS
+
+elif [ "$MODE" == "auto" ]; then
+    # Hybrid mode with each rank's cores inside one NUMA domain, threads kept next to each other
+    export OMP_PROC_BIND=close
+    srun --ntasks-per-node=$ARG3 --cpus-per-task=$THREADS --cpu-bind=cores ./project2 $RUN_ARGS
 fi
 
 # If srun exited due to timeout or error
 if [ $? -ne 0 ]; then
     echo "[SBATCH] Srun terminated due to exceeding the time limit or error"
-    # break
 fi
-
-#   # Increase matrix size by increment amount
-#   SIZE=$(($SIZE + $INCREMENT))
-#   echo "[SBATCH] Increasing matrix size to $SIZE"
-# done